@@ -0,0 +1,270 @@
+/* crc5066.c  -  NATO STANAG 5066 Annex C header and data CRCs
+ * Copyright (c) 2006 Sampo Kellomaki (sampo@iki.fi), All Rights Reserved.
+ * See file COPYING.
+ *
+ * Both CRCs are bit reflected (LSB first), start from zero, and have no final
+ * xor. The bit-at-a-time functions are the reference given in the specification.
+ * Batch functions use slicing-by-8 tables, i.e. eight bytes are consumed per
+ * round with eight table lookups. On x86-64 CPUs that have PCLMULQDQ the bulk
+ * of a CRC-32 is instead folded 64 bytes at a time with carry-less multiplies,
+ * see "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction",
+ * Intel, 2009. CRC-16 only covers the short D_PDU headers so tables suffice.
+ * The CRC-32 engines can also copy the data as they go, see CRC_32_S5066_copy().
+ */
+
+#include "errmac.h"
+#include "s5066.h"
+
+#include <memory.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && __GNUC__ >= 5
+#define CRC_CLMUL 1
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#endif
+
+#define CRC_16_POLY 0x9299
+#define CRC_32_POLY 0xf3a4e550
+
+/* From S5066 specification, Annex C, paragraph C.3.2.8, p. C-13. Not optimized. */
+
+unsigned short CRC_16_S5066(unsigned char DATA, unsigned short CRC)
+{
+  unsigned char i, bit;
+  for (i=0x01; i; i<<=1) {
+    bit = ( ((CRC & 0x0001) ? 1:0) ^ ((DATA & i) ? 1:0) );
+    CRC >>= 1;
+    if (bit)
+      CRC ^= CRC_16_POLY;
+  }
+  return CRC;
+}
+
+unsigned int CRC_32_S5066(unsigned char DATA, unsigned int CRC)
+{
+  unsigned char i, bit;
+  for (i=0x01; i; i<<=1) {
+    bit = ( ((CRC & 0x0001) ? 1:0) ^ ((DATA & i) ? 1:0) );
+    CRC >>= 1;
+    if (bit)
+      CRC ^= CRC_32_POLY;
+  }
+  return CRC;
+}
+
+/* crc_tab[k][b] is the CRC of byte b followed by k zero bytes. Filled by crc_s5066_init(). */
+
+static unsigned short crc16_tab[8][256];
+static unsigned int crc32_tab[8][256];
+static int crc_clmul;  /* CPU can do PCLMULQDQ and SSE4.1 */
+
+unsigned short CRC_16_S5066_upd(unsigned short CRC, char* p, char* lim)
+{
+  unsigned char* q = (unsigned char*)p;
+  unsigned int a;
+  for (; (unsigned char*)lim - q >= 8; q += 8) {
+    a = CRC ^ (q[0] | q[1] << 8);
+    CRC = crc16_tab[7][a & 0xff] ^ crc16_tab[6][a >> 8]
+      ^ crc16_tab[5][q[2]] ^ crc16_tab[4][q[3]] ^ crc16_tab[3][q[4]]
+      ^ crc16_tab[2][q[5]] ^ crc16_tab[1][q[6]] ^ crc16_tab[0][q[7]];
+  }
+  for (; q < (unsigned char*)lim; ++q)
+    CRC = (CRC >> 8) ^ crc16_tab[0][(CRC ^ *q) & 0xff];
+  return CRC;
+}
+
+/* If d is given, the data is also copied there. */
+
+static unsigned int crc32_tab_upd(unsigned int CRC, unsigned char* q, unsigned char* lim, char* d)
+{
+  unsigned int a;
+  for (; lim - q >= 8; q += 8) {
+    if (d) {
+      memcpy(d, q, 8);
+      d += 8;
+    }
+    a = CRC ^ (q[0] | q[1] << 8 | q[2] << 16 | (unsigned int)q[3] << 24);
+    CRC = crc32_tab[7][a & 0xff] ^ crc32_tab[6][(a >> 8) & 0xff]
+      ^ crc32_tab[5][(a >> 16) & 0xff] ^ crc32_tab[4][a >> 24]
+      ^ crc32_tab[3][q[4]] ^ crc32_tab[2][q[5]] ^ crc32_tab[1][q[6]] ^ crc32_tab[0][q[7]];
+  }
+  for (; q < lim; ++q) {
+    if (d)
+      *d++ = *q;
+    CRC = (CRC >> 8) ^ crc32_tab[0][(CRC ^ *q) & 0xff];
+  }
+  return CRC;
+}
+
+#ifdef CRC_CLMUL
+
+/* Folding constants for the reflected 0xf3a4e550 polynomial, in the notation of
+ * the Intel paper: k1 = x^(4*128+32), k2 = x^(4*128-32), k3 = x^(128+32),
+ * k4 = x^(128-32), and k5 = x^64, each mod P, bit reflected and shifted left by one.
+ * mu = x^64 div P and P itself are 33 bit reflected for the Barrett reduction. */
+
+static const unsigned long long crc32_k1k2[2] __attribute__((aligned(16))) = { 0x09ef855c0ULL, 0x1f5efb4eaULL };
+static const unsigned long long crc32_k3k4[2] __attribute__((aligned(16))) = { 0x1e2b0f7f2ULL, 0x14b4cbeb4ULL };
+static const unsigned long long crc32_k5k0[2] __attribute__((aligned(16))) = { 0x0e13055b2ULL, 0 };
+static const unsigned long long crc32_pmu[2]  __attribute__((aligned(16))) = { 0x1e749caa1ULL, 0x09a1f0ea1ULL };
+
+/* len must be at least 64 and a multiple of 16. If d is given, each 16 byte
+ * block is stored there while it is still in a register. */
+
+__attribute__((target("pclmul,sse4.1")))
+static unsigned int crc32_clmul_upd(unsigned int CRC, unsigned char* q, int len, char* d)
+{
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y1, y2, y3, y4;
+
+  x1 = _mm_loadu_si128((__m128i*)(q + 0x00));
+  x2 = _mm_loadu_si128((__m128i*)(q + 0x10));
+  x3 = _mm_loadu_si128((__m128i*)(q + 0x20));
+  x4 = _mm_loadu_si128((__m128i*)(q + 0x30));
+  if (d) {
+    _mm_storeu_si128((__m128i*)(d + 0x00), x1);
+    _mm_storeu_si128((__m128i*)(d + 0x10), x2);
+    _mm_storeu_si128((__m128i*)(d + 0x20), x3);
+    _mm_storeu_si128((__m128i*)(d + 0x30), x4);
+    d += 64;
+  }
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(CRC));
+  x0 = _mm_load_si128((__m128i*)crc32_k1k2);
+  q += 64;
+  len -= 64;
+
+  for (; len >= 64; q += 64, len -= 64) {  /* Fold four lanes in parallel */
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    y1 = _mm_loadu_si128((__m128i*)(q + 0x00));
+    y2 = _mm_loadu_si128((__m128i*)(q + 0x10));
+    y3 = _mm_loadu_si128((__m128i*)(q + 0x20));
+    y4 = _mm_loadu_si128((__m128i*)(q + 0x30));
+    if (d) {
+      _mm_storeu_si128((__m128i*)(d + 0x00), y1);
+      _mm_storeu_si128((__m128i*)(d + 0x10), y2);
+      _mm_storeu_si128((__m128i*)(d + 0x20), y3);
+      _mm_storeu_si128((__m128i*)(d + 0x30), y4);
+      d += 64;
+    }
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y1);
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y2);
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y3);
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y4);
+  }
+
+  x0 = _mm_load_si128((__m128i*)crc32_k3k4);  /* Fold the lanes into one */
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  for (; len >= 16; q += 16, len -= 16) {
+    y1 = _mm_loadu_si128((__m128i*)q);
+    if (d) {
+      _mm_storeu_si128((__m128i*)d, y1);
+      d += 16;
+    }
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, y1), x5);
+  }
+
+  /* 128 bits to 64 bits */
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x0 = _mm_loadl_epi64((__m128i*)crc32_k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /* Barrett reduction to 32 bits */
+  x0 = _mm_load_si128((__m128i*)crc32_pmu);
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+static unsigned int crc32_upd(unsigned int CRC, char* p, char* lim, char* d)
+{
+  unsigned char* q = (unsigned char*)p;
+#ifdef CRC_CLMUL
+  int n = ((unsigned char*)lim - q) & ~15;
+  if (crc_clmul && n >= 64) {
+    CRC = crc32_clmul_upd(CRC, q, n, d);
+    q += n;
+    if (d)
+      d += n;
+  }
+#endif
+  return crc32_tab_upd(CRC, q, (unsigned char*)lim, d);
+}
+
+unsigned int CRC_32_S5066_upd(unsigned int CRC, char* p, char* lim)
+{
+  return crc32_upd(CRC, p, lim, 0);
+}
+
+/* Copy p..lim to d and return CRC-32 of the data, touching each byte once.
+ * Used to verify received segments while moving them into place. */
+
+unsigned int CRC_32_S5066_copy(char* d, char* p, char* lim)
+{
+  return crc32_upd(0, p, lim, d);
+}
+
+unsigned short CRC_16_S5066_batch(char* p, char* lim)
+{
+  return CRC_16_S5066_upd(0, p, lim);
+}
+
+unsigned int CRC_32_S5066_batch(char* p, char* lim)
+{
+  return CRC_32_S5066_upd(0, p, lim);
+}
+
+/* Build the tables and pick the CRC-32 engine. Must be called before any
+ * threads are started. See crctest.c for checking them against the reference. */
+
+void crc_s5066_init()
+{
+  int i, k;
+
+  for (i = 0; i < 256; ++i) {
+    crc16_tab[0][i] = CRC_16_S5066(i, 0);
+    crc32_tab[0][i] = CRC_32_S5066(i, 0);
+  }
+  for (k = 1; k < 8; ++k)
+    for (i = 0; i < 256; ++i) {
+      crc16_tab[k][i] = (crc16_tab[k-1][i] >> 8) ^ crc16_tab[0][crc16_tab[k-1][i] & 0xff];
+      crc32_tab[k][i] = (crc32_tab[k-1][i] >> 8) ^ crc32_tab[0][crc32_tab[k-1][i] & 0xff];
+    }
+
+#ifdef CRC_CLMUL
+  {
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+      crc_clmul = (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+  }
+#endif
+  D("crc clmul(%d)", crc_clmul);
+}
+
+/* EOF  --  crc5066.c */
@@ -0,0 +1,103 @@
+/* crctest.c  -  Check the batch CRCs against the reference and measure them
+ * Copyright (c) 2006 Sampo Kellomaki (sampo@iki.fi), All Rights Reserved.
+ * See file COPYING.
+ *
+ * Usage: make crctest; ./crctest [MB]
+ *
+ * Every length up to two segments, at a few misalignments, is checked against
+ * the bit-at-a-time functions of Annex C, then each function crunches MB
+ * megabytes (default 64) of D_PDU sized buffers and its speed is reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "errmac.h"
+#include "s5066.h"
+
+char* instance = "crctest";
+int debug = 1;  /* crc_s5066_init() tells which CRC-32 engine it picked */
+
+static char buf[2*DTS_SEG_SIZE + 8];
+static char cpy[2*DTS_SEG_SIZE + 8];
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static unsigned int crc32_ref(char* p, char* lim)
+{
+  unsigned int c = 0;
+  for (; p < lim; ++p)
+    c = CRC_32_S5066(*p, c);
+  return c;
+}
+
+static int check()
+{
+  unsigned int c, len;
+  unsigned short c16;
+  int i, k, bad = 0;
+  for (len = 0; len <= 2*DTS_SEG_SIZE; len += (len < 200) ? 1 : 37)
+    for (k = 0; k < 8; k += 3) {
+      for (c16 = 0, c = 0, i = k; i < k + len; ++i) {
+	c16 = CRC_16_S5066(buf[i], c16);
+	c = CRC_32_S5066(buf[i], c);
+      }
+      if (c16 != CRC_16_S5066_batch(buf + k, buf + k + len)) {
+	printf("CRC-16 mismatch len(%d) align(%d)\n", len, k);
+	++bad;
+      }
+      if (c != CRC_32_S5066_batch(buf + k, buf + k + len)) {
+	printf("CRC-32 mismatch len(%d) align(%d)\n", len, k);
+	++bad;
+      }
+      if (c != CRC_32_S5066_copy(cpy, buf + k, buf + k + len) || memcmp(cpy, buf + k, len)) {
+	printf("CRC-32 copy mismatch len(%d) align(%d)\n", len, k);
+	++bad;
+      }
+    }
+  return bad;
+}
+
+#define BENCH(name, expr) MB \
+  t = now(); \
+  for (n = 0; n < rounds; ++n) \
+    sum += (expr); \
+  t = now() - t; \
+  printf("%-24s %8.1f MB/s\n", name, rounds * (double)DTS_SEG_SIZE / 1e6 / t); \
+  rounds = all / DTS_SEG_SIZE; ME
+
+int main(int argc, char** argv, char** env)
+{
+  unsigned int a, sum = 0;
+  long long all = (argc > 1 ? atoi(argv[1]) : 64) * 1000000LL;
+  int i, n, rounds;
+  double t;
+
+  crc_s5066_init();
+  for (a = 1, i = 0; i < sizeof(buf); ++i) {
+    a = a * 1103515245 + 12345;
+    buf[i] = a >> 16;
+  }
+  if (check()) {
+    printf("FAIL\n");
+    return 1;
+  }
+  printf("batch CRCs agree with reference\n");
+
+  rounds = all / DTS_SEG_SIZE / 64;  /* the reference is slow, spare it */
+  BENCH("CRC_32_S5066 (reference)", crc32_ref(buf, buf + DTS_SEG_SIZE));
+  BENCH("CRC_16_S5066_batch", CRC_16_S5066_batch(buf, buf + DTS_SEG_SIZE));
+  BENCH("CRC_32_S5066_batch", CRC_32_S5066_batch(buf, buf + DTS_SEG_SIZE));
+  BENCH("CRC_32_S5066_copy", CRC_32_S5066_copy(cpy, buf, buf + DTS_SEG_SIZE));
+  D("sum(%x)", sum);  /* keeps the compiler from dropping the loops */
+  return 0;
+}
+
+/* EOF  --  crctest.c */
@@ -14,6 +14,7 @@
 
 #include <ctype.h>
 #include <memory.h>
+#include <stdlib.h>
 #include <netinet/in.h> /* htons(3) and friends */
 
 #define DTS_MIN_PDU_SIZE 6     /* sync + d_type + EOW + length fields */
@@ -24,48 +25,6 @@
 #define DTS_SEG_C_PDU_SIZE(r, addr_size) ((DTS_SHB((r), (addr_size), 0) & 0x03) << 8 \
                                          | DTS_SHB((r), (addr_size), 1) & 0x00ff)
 
-/* From S5066 specification, Annex C, paragraph C.3.2.8, p. C-13. Not optimized. */
-
-unsigned short CRC_16_S5066(unsigned char DATA, unsigned short CRC)
-{
-  unsigned char i, bit;
-  for (i=0x01; i; i<<=1) {
-    bit = ( ((CRC & 0x0001) ? 1:0) ^ ((DATA & i) ? 1:0) );
-    CRC >>= 1;
-    if (bit)
-      CRC ^= 0x9299;
-  }
-  return CRC;
-}
-
-unsigned short CRC_16_S5066_batch(char* p, char* lim)
-{
-  unsigned short CRC = 0;
-  for (; p < lim; ++p)
-    CRC = CRC_16_S5066((unsigned char)*p,  CRC);
-  return CRC;
-}
-
-unsigned int CRC_32_S5066(unsigned char DATA, unsigned int CRC)
-{
-  unsigned char i, bit;
-  for (i=0x01; i; i<<=1) {
-    bit = ( ((CRC & 0x0001) ? 1:0) ^ ((DATA & i) ? 1:0) );
-    CRC >>= 1;
-    if (bit)
-      CRC ^= 0xf3a4e550;
-  }
-  return CRC;
-}
-
-unsigned int CRC_32_S5066_batch(char* p, char* lim)
-{
-  unsigned int CRC = 0;
-  for (; p < lim; ++p)
-    CRC = CRC_32_S5066((unsigned char)*p,  CRC);
-  return CRC;
-}
-
 /* N.B. This code tries to keep the addresses intact, even if they are not
  * optimally encoded. Client should set the addresses in optimal way.
  * For station address matching we need some canonical representation,
@@ -104,11 +63,13 @@ void dts_dec_two_addr(int len, char* addr, char* t, char* f)
   int i,j;
   
   t[0] = (len << 5) & 0x00e0;
-  for (j = 4, i = 0; i < len; ++i, ++j)    /* Copy nibbles, avoiding the first, which is len */
+  t[1] = t[2] = t[3] = 0;
+  for (j = 1, i = 0; i < len; ++i, ++j)    /* Copy nibbles, avoiding the first, which is len */
     SET_NIBBLE(t, j, GET_NIBBLE(addr, i));
   
   f[0] = (len << 5) & 0x00e0;
-  for (j = 4; i < len+len; ++i, ++j)       /* Copy nibbles, avoiding the first, which is len */
+  f[1] = f[2] = f[3] = 0;
+  for (j = 1; i < len+len; ++i, ++j)       /* Copy nibbles, avoiding the first, which is len */
     SET_NIBBLE(f, j, GET_NIBBLE(addr, i));
   
   /* *** More efficient implementation may be possible by unrolling the loops
@@ -119,16 +80,22 @@ void dts_dec_two_addr(int len, char* addr, char* t, char* f)
 /* ================== SENDING DTS PRIMITIVES ================== */
 
 char my_station_addr[] = { 0xe1, 0x23, 0x45, 0x67 };
+int dts_bps = DTS_BPS;  /* modem data rate, for EOT and C_PDU reception window */
+char dts_pace = 0;      /* pace all links at dts_bps, see -bps */
+int dts_nonarq_ttl = DTS_NONARQ_TTL;  /* see -nonarqttl */
 
 struct hi_pdu* dts_encode_start(struct hi_thr* hit, int op, int eow, char* to, int hdr_len)
 {
-  struct hi_pdu* resp = hi_pdu_alloc(hit);
+  /* room for preamble, longest header and address, header CRC and data CRC */
+  struct hi_pdu* resp = hi_pdu_alloc(hit, DTS_HDR_ROOM + 4);
   if (!resp) { NEVERNEVER("*** out of pdus in bad place %d", op); }
   resp->m[0] = 0x90;   /* Maury-Styles */
   resp->m[1] = 0xeb;
   resp->m[2] = (op << 4) & 0xf0 | (eow >> 8) & 0x0f;
   resp->m[3] = eow & 0x00ff;
-  resp->m[4] = 0;  /* EOT will be sent just before writev(2) at lower layer */
+  resp->m[4] = 0;  /* EOT is set just before writev(2), see dts_late_bind() */
+  if (op == DTS_EDATA_ONLY || op == DTS_EACK_ONLY || op == DTS_ENONARQ)
+    resp->qel.flags |= HI_F_URGENT;  /* written ahead of normal D_PDUs, see hi_send0() */
   resp->ad.dts.addr_len = dts_enc_two_addr(resp->m + 6, to, my_station_addr);
   resp->m[5] = resp->ad.dts.addr_len << 5 | hdr_len & 0x001f;
 
@@ -140,27 +107,31 @@ struct hi_pdu* dts_encode_start(struct hi_thr* hit, int op, int eow, char* to, i
 void dts_send_uni_final(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, struct hi_pdu* resp, int seg_size, char* p)
 {
   unsigned int data_crc32;
-  /* Grab memory for  data CRC right after the header */
+  char* c = resp->m + DTS_HDR_ROOM;  /* data CRC past the longest header, see dts_late_bind() */
   data_crc32 = CRC_32_S5066_batch(p, p + seg_size);
-  resp->ap[0] = (data_crc32 >> 24) & 0x00ff;
-  resp->ap[1] = (data_crc32 >> 16) & 0x00ff;
-  resp->ap[2] = (data_crc32 >> 8) & 0x00ff;
-  resp->ap[3] = data_crc32 & 0x00ff;
-  resp->ap += 4;
-  hi_send3(hit, io, req, resp, resp->len, resp->m, seg_size, p, 4, resp->m + resp->len);
+  c[0] = (data_crc32 >> 24) & 0x00ff;
+  c[1] = (data_crc32 >> 16) & 0x00ff;
+  c[2] = (data_crc32 >> 8) & 0x00ff;
+  c[3] = data_crc32 & 0x00ff;
+  hi_send3(hit, io, req, resp, resp->len, resp->m, seg_size, p, 4, c);
 }
 
-void dts_send_uni_nonarq_seg(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int len, char* d, int seg_size, char* p)
+/* Build and send the NONARQ (or ENONARQ, op) D_PDU of one segment. Returns resp, held, so that
+ * repeats can resend the same header and CRCs, see dts_sched_send().
+ * rest and rest_segs count the payload and D_PDUs of the C_PDU still to be
+ * sent after this one, for the reception window. */
+
+struct hi_pdu* dts_send_uni_nonarq_seg(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int op, int c_pdu_id, int len, char* d, int seg_size, char* p, int rest, int rest_segs)
 {
   struct hi_pdu* resp;
   unsigned short hdr_crc16;
   char* h;
 
-  resp = dts_encode_start(hit, DTS_NONARQ, 0, req->m + 7, DTS_MIN_PDU_SIZE - 2 + 9);
+  resp = dts_encode_start(hit, op, 0, req->m + 7, DTS_MIN_PDU_SIZE - 2 + 9);
   h = resp->m + DTS_MIN_PDU_SIZE + resp->ad.dts.addr_len;
-  h[0] = (io->ad.dts->c_pdu_id >> 4) & 0x00f0 | (seg_size >> 8) & 0x03;
+  h[0] = (c_pdu_id >> 4) & 0x00f0 | (seg_size >> 8) & 0x03;
   h[1] = seg_size & 0x00ff;
-  h[2] = io->ad.dts->c_pdu_id & 0x00ff;
+  h[2] = c_pdu_id & 0x00ff;
   
   h[3] = (len >> 8) & 0x00ff;   /* C_PDU overall size */
   h[4] = len & 0x00ff;
@@ -168,143 +139,552 @@ void dts_send_uni_nonarq_seg(struct hi_thr* hit, struct hi_io* io, struct hi_pdu
   h[5] = ((p-d) >> 8) & 0x00ff; /* C_PDU segment offset */
   h[6] = (p-d) & 0x00ff;
   
-  h[7] = 0;   /* C_PDU reception window will be set at low */
-  h[8] = 0;   /* level in manner similar to EOT */
+  h[7] = 0;   /* C_PDU reception window is set just */
+  h[8] = 0;   /* before writev(2), like EOT */
   
   hdr_crc16 = CRC_16_S5066_batch(resp->m + 2, h + 9);
   h[9] = (hdr_crc16 >> 8) & 0x00ff;
   h[10] = hdr_crc16 & 0x00ff;
   ASSERTOP(h+11, ==, resp->ap);
   
+  resp->ad.dts.c_pdu_rest = rest + rest_segs * (resp->len + 4);
+  hi_pdu_hold(resp);  /* writev(2) may complete, and release resp, before we return */
   dts_send_uni_final(hit, io, req, resp, seg_size, p);
+  return resp;
 }
 
-void dts_send_uni_nonarq(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int len, char* d)
+/* Resend an already built D_PDU. The new PDU gets its own copy of the header,
+ * since dts_late_bind() rewrites it, but its iovs point to the data CRC in seg
+ * and to the payload in the SIS request. */
+
+void dts_resend_seg(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* seg, int c_pdu_rest)
 {
-  char* lim = d + len;
-  char* p = d;
-  
-  /* Segment the c_pdu and prepare and send a d_pdu for every segment. */
-  
-  for (; lim-p > DTS_SEG_SIZE; p += DTS_SEG_SIZE)
-    dts_send_uni_nonarq_seg(hit, io, req, len, d, DTS_SEG_SIZE, p);
-  dts_send_uni_nonarq_seg(hit, io, req, len, d, lim-p, p);   /* Last segment */
+  struct hi_pdu* resp = hi_pdu_alloc(hit, DTS_HDR_ROOM);
+  if (!resp) { NEVERNEVER("*** out of pdus in bad place %d", seg->n_iov); }
+  memcpy(resp->m, seg->m, seg->iov[0].iov_len);
+  resp->len = seg->iov[0].iov_len;
+  resp->ad.dts.n_tx_seq = seg->ad.dts.n_tx_seq;
+  resp->ad.dts.addr_len = seg->ad.dts.addr_len;
+  resp->ad.dts.c_pdu_rest = c_pdu_rest;
+  resp->qel.flags = seg->qel.flags;
+  hi_send3(hit, io, seg, resp, resp->len, resp->m,
+	   seg->iov[1].iov_len, seg->iov[1].iov_base, seg->iov[2].iov_len, seg->iov[2].iov_base);
 }
 
-void dts_send_uni_arq_seg(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int seg_size, char* p, int flags, int n_tx_seq)
+/* ================== ARQ (C.3.4 and C.6.3) ================== */
+
+/* Segments of ARQ C_PDUs are numbered with 8 bit TX frame sequence numbers.
+ * At most DTS_ARQ_WIN D_PDUs may be unacked. Each one is held in tx_pdus[] so
+ * that it can be resent, with the same header and CRCs, until it is acked.
+ * C_PDUs that do not fit in the window wait in the scheduler, see dts_sched_send(). The receiver acks with
+ * its rx_lwe and a bitmap of D_PDUs it holds beyond rx_lwe. Gaps below a
+ * selectively acked D_PDU are resent right away, anything else once
+ * DTS_ARQ_RTO passes without progress. Expedited data runs the same protocol
+ * with EDATA-ONLY and EACK-ONLY in a channel of its own, see struct dts_chan.
+ * All of this is protected by dts->mut. */
+
+static void dts_sched_pull(struct hi_thr* hit, struct hi_io* io);
+static void dts_flow_on(struct hi_thr* hit, struct hi_io* io);
+
+struct dts_conn* dts_new_conn()
+{
+  struct dts_conn* dts;
+  int i;
+  ZMALLOC(dts);
+  pthread_mutex_init(&dts->mut, MUTEXATTR);
+  pthread_mutex_init(&dts->ack_mut, MUTEXATTR);
+  dts->ch[DTS_CH_NORMAL].tx_sack_hi = dts->ch[DTS_CH_EXPEDITED].tx_sack_hi = -1;
+  dts->ch[DTS_CH_EXPEDITED].expedited = 1;
+  for (i = 0; i < DTS_NONARQ_SLOTS; ++i)
+    dts->ch[DTS_CH_NORMAL].nonarq[i].c_pdu_id = dts->ch[DTS_CH_EXPEDITED].nonarq[i].c_pdu_id = -1;
+  dts->bps = dts_bps;
+  dts->paced = dts_pace;
+  return dts;
+}
+
+/* Free what a DTS link holds once hi_close() has dropped its write queue: the
+ * unacked and out of order ARQ D_PDUs, C_PDUs being reassembled, and the C_PDUs
+ * queued in the scheduler, which release their SIS requests. Any FLOW_OFF the
+ * link caused is withdrawn, see dts_flow_on(). The link is taken
+ * out of the routes first so that no sender picks it any more, and senders that
+ * already did have it pinned, see dts_send_uni(), so hi_close() waited for them. */
+
+void dts_close_conn(struct hi_thr* hit, struct hi_io* io)
+{
+  struct dts_conn* dts = io->ad.dts;
+  struct dts_chan* ch;
+  struct dts_flow* fl;
+  struct hi_pdu* cp;
+  struct hi_pdu* seg;
+  int i;
+  if (io->qel.proto != S5066_DTS || !dts)
+    return;
+  dts_route_drop(io);
+  LOCK(dts->mut, "close");
+  for (ch = dts->ch; ch < dts->ch + DTS_N_CH; ++ch) {
+    for (i = 0; i < 256; ++i) {
+      if (ch->tx_pdus[i])
+	hi_pdu_release(hit, ch->tx_pdus[i]);
+      if (ch->rx_pdus[i])
+	hi_pdu_release(hit, ch->rx_pdus[i]);
+    }
+    if (ch->rx_c_pdu)
+      hi_pdu_free(hit, ch->rx_c_pdu);
+    for (i = 0; i < DTS_NONARQ_SLOTS; ++i)
+      if (ch->nonarq[i].pdu)
+	hi_pdu_free(hit, ch->nonarq[i].pdu);
+  }
+  for (fl = &dts->flows[0][0]; fl < &dts->flows[0][0] + DTS_N_CLASS * SIS_MAX_SAP_ID; ++fl)
+    while ((cp = fl->head)) {
+      fl->head = cp->n;
+      while ((seg = cp->ad.dtsq.segs)) {  /* NONARQ D_PDUs kept for repeats */
+	cp->ad.dtsq.segs = seg->synths;
+	seg->synths = 0;
+	hi_pdu_release(hit, seg);
+      }
+      hi_pdu_release(hit, cp->req);
+      hi_pdu_free(hit, cp);
+    }
+  dts_flow_on(hit, io);
+  D("fd(%x) closed link, junk(%d) hdr_crc_err(%d) crc_err(%d)", io->fd, dts->n_junk, dts->n_hdr_crc_err, dts->n_crc_err);
+  UNLOCK(dts->mut, "close");
+  io->ad.dts = 0;
+  pthread_mutex_destroy(&dts->mut);
+  pthread_mutex_destroy(&dts->ack_mut);
+  free(dts);
+}
+
+/* Build and send the DATA-ONLY (or EDATA-ONLY) D_PDU of one segment and hold it
+ * in tx_pdus[]. If an ACK is due when it is written, it goes out as DATA-ACK instead. */
+
+static void dts_arq_send_seg(struct hi_thr* hit, struct hi_io* io, struct dts_chan* ch, struct hi_pdu* req, int seg_size, char* p, int flags, int seq)
 {
   struct hi_pdu* resp;
   unsigned short hdr_crc16;
-  int i,j;
   char* h;
   
-  if (!(flags & 0x80)                                    /* latter parts of multisegment, no ACKs */
-      || (io->ad.dts->rx_lwe == io->ad.dts->rx_lwe)) {   /* rx window is empty, no ACKs needed */
-    resp = dts_encode_start(hit, DTS_DATA_ONLY, 0, req->m + 7, 4+4+2);
-    h = resp->m + 6 + resp->ad.dts.addr_len;
-    io->ad.dts->tx_pdus[n_tx_seq & 0x00ff] = resp;
-    h[0] = flags | (seg_size >> 8) & 0x03
-      | ((n_tx_seq == io->ad.dts->tx_uwe) ? 0x80 : 0)
-      | ((n_tx_seq == io->ad.dts->tx_lwe) ? 0x40 : 0);
-    h[1] = seg_size & 0x00ff;
-    h[2] = n_tx_seq & 0x00ff;
-    
-    hdr_crc16 = CRC_16_S5066_batch(resp->m + 2, h + 3);
-    h[3] = (hdr_crc16 >> 8) & 0x00ff;
-    h[4] = hdr_crc16 & 0x00ff;
-    ASSERTOP(h+5, ==, resp->ap);
-  } else {
-    /* *** Ideally the ack computation should not happen yet. Essentially we should
-     * add the ACK payload just before we pump the PDU in transit. Especially for
-     * latter segments of segmented C_PDU we probably should not be sending the ACKs */
-    int ack_len = (io->ad.dts->rx_uwe - io->ad.dts->rx_lwe) / 8;
-    resp = dts_encode_start(hit, DTS_DATA_ACK, 0, req->m + 7, 4+3+ack_len+2);
-    h = resp->m + 6 + resp->ad.dts.addr_len;
-    io->ad.dts->tx_pdus[n_tx_seq & 0x00ff] = resp;
-    h[0] = flags | (seg_size >> 8) & 0x03
-      | ((n_tx_seq == io->ad.dts->tx_uwe) ? 0x80 : 0)
-      | ((n_tx_seq == io->ad.dts->tx_lwe) ? 0x40 : 0);
-    h[1] = seg_size & 0x00ff;
-    h[2] = n_tx_seq & 0x00ff;
-    h[3] = io->ad.dts->rx_lwe & 0x00ff;
-    
-    memset(h + 4, 0, ack_len);
-    for (i = 0, j = io->ad.dts->rx_lwe + 1; j <= io->ad.dts->rx_uwe; ++j, ++i)
-      if (GET_BIT(io->ad.dts->acks, j & 0x00ff))
-	SET_BIT(h + 4, i, 1);
-    
-    hdr_crc16 = CRC_16_S5066_batch(resp->m + 2, h + 4 + ack_len);
-    h[4 + ack_len] = (hdr_crc16 >> 8) & 0x00ff;
-    h[5 + ack_len] = hdr_crc16 & 0x00ff;
-    ASSERTOP(h+5+ack_len, ==, resp->ap);
-  }
+  resp = dts_encode_start(hit, ch->expedited ? DTS_EDATA_ONLY : DTS_DATA_ONLY, 0, req->m + 7, DTS_MIN_PDU_SIZE - 2 + 3);
+  h = resp->m + DTS_MIN_PDU_SIZE + resp->ad.dts.addr_len;
+  h[0] = flags | (seq == ch->tx_lwe ? DTS_F_LWE : 0) | (seg_size >> 8) & 0x03;
+  h[1] = seg_size & 0x00ff;
+  h[2] = seq;
+  
+  hdr_crc16 = CRC_16_S5066_batch(resp->m + 2, h + 3);
+  h[3] = (hdr_crc16 >> 8) & 0x00ff;
+  h[4] = hdr_crc16 & 0x00ff;
+  ASSERTOP(h+5, ==, resp->ap);
+  
+  resp->ad.dts.n_tx_seq = seq;
+  hi_pdu_hold(resp);  /* until acked, see dts_arq_ack() */
+  ch->tx_pdus[seq] = resp;
   dts_send_uni_final(hit, io, req, resp, seg_size, p);
 }
 
-int dts_expand_tx_window(struct hi_io* io)
+/* Resend every unacked D_PDU if nothing has happened for DTS_ARQ_RTO. The link
+ * is woken up when that time comes, see hi_wake_at(). If the window moved in the
+ * mean time, we just ask to be woken up again. */
+
+static void dts_arq_timeout(struct hi_thr* hit, struct hi_io* io)
+{
+  struct dts_chan* ch;
+  int seq;
+  time_t now = time(0);
+  for (ch = io->ad.dts->ch; ch < io->ad.dts->ch + DTS_N_CH; ++ch) {
+    if (ch->tx_lwe == ch->tx_nxt)
+      continue;
+    if (now - ch->tx_time < DTS_ARQ_RTO) {
+      hi_wake_at(io, (ch->tx_time + DTS_ARQ_RTO) * 1000000LL);
+      continue;
+    }
+    D("ARQ timeout tx_lwe(%d) tx_nxt(%d) exp(%d)", ch->tx_lwe, ch->tx_nxt, ch->expedited);
+    for (seq = ch->tx_lwe; seq != ch->tx_nxt; seq = (seq + 1) & 0xff)
+      if (ch->tx_pdus[seq])
+	dts_resend_seg(hit, io, ch->tx_pdus[seq], 0);
+    ch->tx_time = now;
+    hi_wake_at(io, (now + DTS_ARQ_RTO) * 1000000LL);
+  }
+}
+
+/* Process ACK of a DATA-ACK, ACK-ONLY, or EACK-ONLY D_PDU: rx_lwe, and bitmap of map_len bytes
+ * for D_PDUs rx_lwe+1 onwards (C.3.4, p. C-18). */
+
+static void dts_arq_ack(struct hi_thr* hit, struct hi_io* io, struct dts_chan* ch, int rx_lwe, char* map, int map_len)
+{
+  int i, seq, sack_hi = -1, in_win = (ch->tx_nxt - ch->tx_lwe) & 0xff;
+  
+  rx_lwe &= 0xff;
+  if (((rx_lwe - ch->tx_lwe) & 0xff) > in_win) {
+    D("ACK rx_lwe(%d) outside window tx_lwe(%d) tx_nxt(%d)", rx_lwe, ch->tx_lwe, ch->tx_nxt);
+    return;
+  }
+  if (rx_lwe != ch->tx_lwe)
+    ch->tx_time = time(0);
+  for (; ch->tx_lwe != rx_lwe; ch->tx_lwe = (ch->tx_lwe + 1) & 0xff) {
+    if (ch->tx_pdus[ch->tx_lwe]) {
+      hi_pdu_release(hit, ch->tx_pdus[ch->tx_lwe]);
+      ch->tx_pdus[ch->tx_lwe] = 0;
+    }
+    if (ch->tx_lwe == ch->tx_sack_hi)
+      ch->tx_sack_hi = -1;
+  }
+  
+  in_win = (ch->tx_nxt - ch->tx_lwe) & 0xff;
+  for (i = 0; i < map_len * 8 && i + 1 < in_win; ++i)
+    if (GET_BIT(map, i)) {
+      seq = (rx_lwe + 1 + i) & 0xff;
+      sack_hi = i + 1;
+      if (ch->tx_pdus[seq]) {
+	hi_pdu_release(hit, ch->tx_pdus[seq]);
+	ch->tx_pdus[seq] = 0;
+      }
+    }
+  
+  if (sack_hi > 0) {  /* resend gaps below highest selectively acked, unless done already */
+    i = ch->tx_sack_hi == -1 ? 0 : ((ch->tx_sack_hi - rx_lwe) & 0xff) + 1;
+    for (; i < sack_hi; ++i) {
+      seq = (rx_lwe + i) & 0xff;
+      if (ch->tx_pdus[seq]) {
+	D("ARQ resend gap seq(%d)", seq);
+	dts_resend_seg(hit, io, ch->tx_pdus[seq], 0);
+      }
+    }
+    if (ch->tx_sack_hi == -1 || ((ch->tx_sack_hi - rx_lwe) & 0xff) < sack_hi)
+      ch->tx_sack_hi = (rx_lwe + sack_hi) & 0xff;
+  }
+  dts_sched_pull(hit, io);  /* window may have opened */
+}
+
+/* ================== TRANSMIT SCHEDULER ================== */
+
+/* C_PDUs from SIS clients are not segmented to the write queue of the link
+ * right away. Instead they queue in flows, one per SAP and class, where class
+ * is the SIS priority, or DTS_CLASS_EXPEDITED. Whenever the link can take more,
+ * dts_sched_pull() picks the next D_PDU: strict priority between classes,
+ * deficit round robin between flows of a class. Since only DTS_SCHED_DEPTH
+ * D_PDUs are handed to the write queue ahead of time, urgent data overtakes
+ * bulk data between D_PDUs, rather than waiting behind whole C_PDUs.
+ * Expedited data does not even wait for that: it is sent as soon as it is
+ * queued, and its D_PDUs are written ahead of anything in the write queue.
+ * All of this is protected by dts->mut. */
+
+/* Payload size of the next D_PDU of queued C_PDU cp */
+
+static int dts_sched_seg_size(struct hi_pdu* cp)
+{
+  if (cp->scan < cp->lim)
+    return MIN(cp->lim - cp->scan, DTS_SEG_SIZE);
+  return cp->ad.dtsq.seg->iov[1].iov_len;  /* NONARQ repeat */
+}
+
+/* Send the next D_PDU of cp. Returns 0 if it can not be sent now (ARQ window
+ * full), 1 if sent, and 2 if that was the last D_PDU of cp. */
+
+static int dts_sched_send(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* cp)
+{
+  struct dts_chan* ch = &io->ad.dts->ch[cp->ad.dtsq.ch];
+  struct hi_pdu* seg;
+  int seg_size, flags, seq, rest, rest_segs, len = cp->lim - cp->m;
+  int n_segs = (len + DTS_SEG_SIZE - 1) / DTS_SEG_SIZE;
+  
+  if (cp->ad.dtsq.arq) {
+    /* The receiver reassembles ARQ C_PDUs of a channel from consecutive
+     * D_PDUs, so they can not be interleaved. NONARQ still can. */
+    if (((ch->tx_nxt - ch->tx_lwe) & 0xff) >= DTS_ARQ_WIN
+	|| ch->tx_arq_cur && ch->tx_arq_cur != cp)
+      return 0;
+    if (ch->tx_nxt == ch->tx_lwe) {
+      ch->tx_time = time(0);  /* window was empty, start the clock */
+      hi_wake_at(io, (ch->tx_time + DTS_ARQ_RTO) * 1000000LL);
+    }
+    seg_size = MIN(cp->lim - cp->scan, DTS_SEG_SIZE);
+    seq = ch->tx_nxt;
+    ch->tx_nxt = (ch->tx_nxt + 1) & 0xff;
+    --ch->n_arq_pend;
+    flags = DTS_F_INORDER;
+    if (cp->scan == cp->m)
+      flags |= DTS_F_START;
+    if (cp->scan + seg_size == cp->lim)
+      flags |= DTS_F_END;
+    if (!ch->n_arq_pend || ((ch->tx_nxt - ch->tx_lwe) & 0xff) == DTS_ARQ_WIN)
+      flags |= DTS_F_UWE;  /* last of burst, prompt an ACK */
+    dts_arq_send_seg(hit, io, ch, cp->req, seg_size, cp->scan, flags, seq);
+    cp->scan += seg_size;
+    if (cp->scan < cp->lim) {
+      ch->tx_arq_cur = cp;
+      return 1;
+    }
+    ch->tx_arq_cur = 0;
+    return 2;
+  }
+  
+  /* NONARQ: rest and rest_segs count what follows this D_PDU, repeats included */
+  
+  if (cp->scan < cp->lim) {  /* first round builds the D_PDUs */
+    seg_size = MIN(cp->lim - cp->scan, DTS_SEG_SIZE);
+    rest = (cp->ad.dtsq.n_tx - 1) * len + cp->lim - cp->scan - seg_size;
+    rest_segs = (cp->ad.dtsq.n_tx - 1) * n_segs + n_segs - 1 - (cp->scan - cp->m) / DTS_SEG_SIZE;
+    seg = dts_send_uni_nonarq_seg(hit, io, cp->req, ch->expedited ? DTS_ENONARQ : DTS_NONARQ,
+				  cp->ad.dtsq.c_pdu_id, len, cp->m, seg_size, cp->scan, rest, rest_segs);
+    cp->scan += seg_size;
+    if (cp->ad.dtsq.n_tx > 1) {  /* keep for repeats */
+      seg->synths = 0;
+      if (cp->ad.dtsq.segs_last)
+	cp->ad.dtsq.segs_last->synths = seg;
+      else
+	cp->ad.dtsq.segs = seg;
+      cp->ad.dtsq.segs_last = seg;
+    } else
+      hi_pdu_release(hit, seg);
+  } else {                   /* later rounds resend them */
+    seg = cp->ad.dtsq.seg;
+    rest = (cp->ad.dtsq.n_tx - 1) * len + MAX(len - (cp->ad.dtsq.seg_ix + 1) * DTS_SEG_SIZE, 0);
+    rest_segs = (cp->ad.dtsq.n_tx - 1) * n_segs + n_segs - 1 - cp->ad.dtsq.seg_ix;
+    dts_resend_seg(hit, io, seg, rest + rest_segs * (seg->iov[0].iov_len + 4));
+    cp->ad.dtsq.seg = seg->synths;
+    ++cp->ad.dtsq.seg_ix;
+  }
+  
+  if (cp->scan < cp->lim || cp->ad.dtsq.seg)
+    return 1;
+  if (--cp->ad.dtsq.n_tx) {  /* round done, start next */
+    cp->ad.dtsq.seg = cp->ad.dtsq.segs;
+    cp->ad.dtsq.seg_ix = 0;
+    return 1;
+  }
+  while ((seg = cp->ad.dtsq.segs)) {
+    cp->ad.dtsq.segs = seg->synths;
+    seg->synths = 0;
+    hi_pdu_release(hit, seg);
+  }
+  return 2;
+}
+
+/* Link has drained, or is closing: withdraw its FLOW_OFF from every SAP that
+ * congested it. The clients of a SAP resume only once no link is congested by
+ * it, see sis_send_flow(). Caller holds dts->mut. */
+
+static void dts_flow_on(struct hi_thr* hit, struct hi_io* io)
 {
-  int n_tx_seq;
-  /* if (tx_window full) return -1; */
-  n_tx_seq = ++io->ad.dts->tx_uwe;
-  return n_tx_seq;
+  struct dts_conn* dts = io->ad.dts;
+  int sap;
+  for (sap = 0; sap < SIS_MAX_SAP_ID; ++sap)
+    if (dts->flow_off & (1 << sap)) {
+      dts->flow_off &= ~(1 << sap);
+      sis_send_flow(hit, sap, 1);
+    }
 }
 
-void dts_send_uni_arq(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int len, char* d)
+/* Send one D_PDU from the most urgent class, between top and bottom, that
+ * has something sendable. Within a class the flow at the head of the ring
+ * sends while its deficit covers the next D_PDU, then the ring turns and the
+ * next flow gets a quantum. Returns 0 if nothing could be sent. */
+
+static int dts_sched_next(struct hi_thr* hit, struct hi_io* io, int top, int bottom)
 {
-  int n_tx_seq;
-  char* lim = d + len;
-  char* p = d;
+  struct dts_conn* dts = io->ad.dts;
+  struct dts_flow* last;
+  struct dts_flow* fl;
+  struct hi_pdu* cp;
+  int cls, visits, size, ret;
   
-  /* Segment the c_pdu and prepare and send a d_pdu for every segment. */
+  for (cls = top; cls >= bottom; --cls) {
+    if (!(dts->class_mask & (1 << cls)))
+      continue;
+    for (visits = 0; visits < 2 * SIS_MAX_SAP_ID; ++visits) {
+      last = dts->active[cls];
+      fl = last->next;
+      cp = fl->head;
+      size = dts_sched_seg_size(cp);
+      if (fl->deficit < size) {
+	fl->deficit += DTS_SCHED_QUANTUM;
+	dts->active[cls] = fl;  /* turn the ring */
+	continue;
+      }
+      if (!(ret = dts_sched_send(hit, io, cp))) {
+	dts->active[cls] = fl;  /* ARQ must wait, give others a chance */
+	continue;
+      }
+      fl->deficit -= size;
+      --dts->n_tx_pend;
+      if (ret == 2) {  /* C_PDU done, the D_PDUs now hold the request */
+	if (!(fl->head = cp->n))
+	  fl->tail = 0;
+	hi_pdu_release(hit, cp->req);
+	hi_pdu_free(hit, cp);
+	if (dts->n_tx_pend < DTS_PEND_LO && dts->flow_off)
+	  dts_flow_on(hit, io);
+	if (!fl->head) {  /* flow went idle, drop it from the ring */
+	  fl->deficit = 0;
+	  if (fl == last) {
+	    dts->active[cls] = 0;
+	    dts->class_mask &= ~(1 << cls);
+	  } else
+	    last->next = fl->next;
+	}
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
 
-  n_tx_seq = dts_expand_tx_window(io); /* *** race from alloc of n_tx_seq to populating tx_pdus */
-  if (n_tx_seq == -1) {
-    D("TX_WIN_FULL tx_lwe(%d) tx_uwe(%d)", io->ad.dts->tx_lwe, io->ad.dts->tx_uwe);
-    return; /* *** add here proper handling of the situation */
+/* Pacing is a token bucket kept as the time it runs dry: tx_clear is when the
+ * modem will have sent everything written to it, at bps, see dts_late_bind().
+ * The next D_PDU is only released once less than DTS_PACE_LEAD of it is left,
+ * so kernel and modem buffers stay nearly empty and whatever is most urgent
+ * at that moment goes out next. Otherwise a wakeup is set for when it is due
+ * and returns 1. Caller holds dts->mut. */
+
+static int dts_pace_hold(struct hi_io* io)
+{
+  struct dts_conn* dts = io->ad.dts;
+  long long now = hi_now_us(), clear;
+  LOCK(dts->ack_mut, "pace");
+  clear = dts->tx_clear;
+  UNLOCK(dts->ack_mut, "pace");
+  if (clear - now <= DTS_PACE_LEAD)
+    return 0;
+  hi_wake_at(io, clear - DTS_PACE_LEAD);
+  return 1;
+}
+
+/* Hand D_PDUs to the write queue of the link as long as it has room. On a
+ * link that keeps up, this sends everything queued, the writev(2)s completing
+ * synchronously. Otherwise it stops at DTS_SCHED_DEPTH and hi_in_out() calls
+ * dts_sched_kick() once the link has drained. A paced link also stops when
+ * the modem has enough to send, see dts_pace_hold(). Expedited data goes
+ * regardless, only its ARQ window holds it back. Caller holds dts->mut. */
+
+static void dts_sched_pull(struct hi_thr* hit, struct hi_io* io)
+{
+  struct dts_conn* dts = io->ad.dts;
+  while (dts->class_mask & (1 << DTS_CLASS_EXPEDITED))
+    if (!dts_sched_next(hit, io, DTS_CLASS_EXPEDITED, DTS_CLASS_EXPEDITED))
+      break;  /* EDATA window full */
+  while (dts->class_mask && !io->in_write && io->n_to_write < DTS_SCHED_DEPTH) {
+    if (dts->paced && dts_pace_hold(io))
+      break;
+    if (!dts_sched_next(hit, io, DTS_CLASS_EXPEDITED - 1, 0))
+      break;
   }
-  dts_send_uni_arq_seg(hit, io, req, DTS_SEG_SIZE, p, 0x80, n_tx_seq); /* 1st seg */
+}
+
+static void dts_nonarq_expire(struct hi_thr* hit, struct hi_io* io);
+
+/* Pinned, as another thread may close the link meanwhile, see dts_close_conn(). */
+
+void dts_sched_kick(struct hi_thr* hit, struct hi_io* io)
+{
+  struct dts_conn* dts;
+  if (!hi_pin(hit, io))
+    return;
+  if (!(dts = io->ad.dts))
+    goto out;
+  if (dts->nonarq_exp && dts->nonarq_exp <= time(0)) {
+    LOCK(dts->mut, "nonarq exp");
+    dts_nonarq_expire(hit, io);
+    UNLOCK(dts->mut, "nonarq exp");
+  }
+  if (!dts->class_mask  /* nothing to send, nor wait ack for */
+      && dts->ch[DTS_CH_NORMAL].tx_lwe == dts->ch[DTS_CH_NORMAL].tx_nxt
+      && dts->ch[DTS_CH_EXPEDITED].tx_lwe == dts->ch[DTS_CH_EXPEDITED].tx_nxt)
+    goto out;
+  LOCK(dts->mut, "sched kick");
+  dts_arq_timeout(hit, io);
+  dts_sched_pull(hit, io);
+  UNLOCK(dts->mut, "sched kick");
+ out:
+  hi_unpin(hit, io);
+}
+
+/* Queue C_PDU of len bytes at d for transmission on io. A PDU handle whose
+ * m..lim spans the C_PDU in the SIS request buffer holds the request, scan tracks
+ * how far it has been segmented. If too much is queued, the SIS client is
+ * asked to hold off. */
+
+static void dts_sched_queue(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int len, char* d, int cls, int arq, int n_tx)
+{
+  struct dts_conn* dts = io->ad.dts;
+  struct dts_chan* ch = &dts->ch[cls == DTS_CLASS_EXPEDITED ? DTS_CH_EXPEDITED : DTS_CH_NORMAL];
+  struct dts_flow* fl;
+  struct hi_pdu* cp = hi_pdu_alloc(hit, 0);
+  int sap = req->fe->ad.sis.sap;
+  int n_segs = (len + DTS_SEG_SIZE - 1) / DTS_SEG_SIZE;
+  if (!cp) { NEVERNEVER("*** out of pdus in bad place %d", len); }
+  cp->m = cp->scan = d;
+  cp->lim = d + len;
+  cp->ad.dtsq.arq = arq;
+  cp->ad.dtsq.ch = ch->expedited;
+  cp->ad.dtsq.n_tx = n_tx;
+  cp->ad.dtsq.segs = cp->ad.dtsq.segs_last = cp->ad.dtsq.seg = 0;
+  cp->ad.dtsq.seg_ix = 0;
+  hi_pdu_hold(req);
+  cp->req = req;
   
-  for (p += DTS_SEG_SIZE; lim-p > DTS_SEG_SIZE; p += DTS_SEG_SIZE) {
-    n_tx_seq = dts_expand_tx_window(io); /* *** race from alloc of n_tx_seq to populating tx_pdus */
-    if (n_tx_seq == -1) {
-      D("TX_WIN_FULL tx_lwe(%d) tx_uwe(%d)", io->ad.dts->tx_lwe, io->ad.dts->tx_uwe);
-      return; /* *** add here proper handling of the situation */
+  LOCK(dts->mut, "sched queue");
+  cp->ad.dtsq.c_pdu_id = ++ch->c_pdu_id;
+  fl = &dts->flows[cls][sap];
+  if (fl->tail)
+    fl->tail->n = cp;
+  else {  /* flow becomes active, add it to the end of the ring */
+    fl->head = cp;
+    if (dts->active[cls]) {
+      fl->next = dts->active[cls]->next;
+      dts->active[cls]->next = fl;
+    } else {
+      fl->next = fl;
+      dts->class_mask |= 1 << cls;
     }
-    dts_send_uni_arq_seg(hit, io, req, DTS_SEG_SIZE, p, 0x00, n_tx_seq);
+    dts->active[cls] = fl;
   }
+  fl->tail = cp;
+  dts->n_tx_pend += arq ? n_segs : n_segs * n_tx;
+  if (arq)
+    ch->n_arq_pend += n_segs;
   
-  n_tx_seq = dts_expand_tx_window(io); /* *** race from alloc of n_tx_seq to populating tx_pdus */
-  if (n_tx_seq == -1) {
-    D("TX_WIN_FULL tx_lwe(%d) tx_uwe(%d)", io->ad.dts->tx_lwe, io->ad.dts->tx_uwe);
-    return; /* *** add here proper handling of the situation */
+  dts_arq_timeout(hit, io);
+  dts_sched_pull(hit, io);
+  if (dts->n_tx_pend > DTS_PEND_HI && !(dts->flow_off & (1 << sap))) {
+    D("link backlog %d D_PDUs, flow off sap(%d)", dts->n_tx_pend, sap);
+    dts->flow_off |= 1 << sap;
+    sis_send_flow(hit, sap, 0);
   }
-  dts_send_uni_arq_seg(hit, io, req, lim-p, p, 0x40, n_tx_seq);   /* Last segment */
+  UNLOCK(dts->mut, "sched queue");
 }
 
 /* N.B. len and d MUST reflect a U_PDU, not a S_PDU and there must be 6 bytes of free space
- * available before d so C_PCI and S_PDU header can be added (at negative offsets). */
+ * available before d so C_PCI and S_PDU header can be added (at negative offsets).
+ * The C_PDU is sent on the link(s) that dts_route() picks for its destination.
+ * S_EXPEDITED_UNIDATA_REQUEST has the same layout, but no priority, and is
+ * sent as expedited data. */
 
-void dts_send_uni(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int len, char* d)
+void dts_send_uni(struct hi_thr* hit, struct hi_pdu* req, int len, char* d, int expedited)
 {
-  int priority   = (d[-11] >> 4) & 0x0f;
-  int dest_sap   = /*req->fe->ad.sap*/ d[-11] & 0x0f;  /* The two saps really should be same */
+  struct hi_io* links[DTS_ROUTE_MAX_LINKS];
+  struct hi_io* io;
+  struct sis_client* cl;
+  int i, n_links;
+  int priority   = expedited ? 0 : (d[-11] >> 4) & 0x0f;
+  int dest_sap   = /*req->fe->ad.sis.sap*/ d[-11] & 0x0f;  /* The two saps really should be same */
   int tx_mode    = (d[-6] >> 4) & 0x0f;
-  int flags      = d[-6] & 0x0f;
   int n_re_tx    = (d[-5] >> 4) & 0x0f;
   int ttl = ((d[-5] & 0x0f) << 16) | (d[-4] << 8) | d[-3];
   
   HEXDUMP("dts_send_uni: ", d, d+len, 800);  /* Should be HMTP payload */
   
-  /* *** perform soft link establishment, if needed (effectively a subrequest) */
+  if (!(n_links = dts_route(d - 10, links))) {
+    ERR("No DTS link to destination(0x%08x)", dts_addr_key(d - 10));
+    return;
+  }
   
-  ++io->ad.dts->c_pdu_id;
+  /* *** perform soft link establishment, if needed (effectively a subrequest) */
   
   /* Prepare C_PCI and S_PDU header */
   
   if (!ttl) {
     d[-4] = C_PDU_DATA; /* C_PCI */
     d[-3] = S_PDU_DATA | priority;
-    d[-2] = (req->fe->ad.sap << 4) & 0xf0 | dest_sap;
+    d[-2] = (req->fe->ad.sis.sap << 4) & 0xf0 | dest_sap;
     d[-1] = 0x00;  /* no valid TTD, no delivery confirmation */
     d -= 4;
     len += 4;
@@ -312,7 +692,7 @@ void dts_send_uni(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int
     int ttd;
     d[-6] = C_PDU_DATA; /* C_PCI */
     d[-5] = S_PDU_DATA | priority;
-    d[-4] = (req->fe->ad.sap << 4) & 0xf0 | dest_sap;
+    d[-4] = (req->fe->ad.sis.sap << 4) & 0xf0 | dest_sap;
     ttd = time(0) + ttl;  /* *** not the real algorithm, see p. A-53 for confusing description */
     d[-3] = 0x40 | (ttd >> 16) & 0x0f;
     d[-2] = (ttd >> 8) & 0xff;
@@ -323,153 +703,549 @@ void dts_send_uni(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int
     
   /* Choose transmission mode */
   
-  if (!tx_mode) {
-    tx_mode = saptab[req->fe->ad.sap].tx_mode;
-    flags   = saptab[req->fe->ad.sap].flags;
-    n_re_tx = saptab[req->fe->ad.sap].n_re_tx;
+  if (!tx_mode && (cl = req->fe->ad.sis.cl)) {  /* as the client asked at bind */
+    tx_mode = cl->tx_mode;
+    n_re_tx = cl->n_re_tx;
   }
   
-  switch (tx_mode) {
-  case 1:
-    dts_send_uni_arq(hit, io, req, len, d);
-    break;
-  default:
+  if (tx_mode != 1 && tx_mode != 2)
     D("Other nonarq tx_mode(%d)", tx_mode);
-    /* fall thru */
-  case 2:    
-    dts_send_uni_nonarq(hit, io, req, len, d);     /* always at least once */
-    for (--n_re_tx; n_re_tx > 0; --n_re_tx)
-      dts_send_uni_nonarq(hit, io, req, len, d);
+  for (i = 0; i < n_links; ++i) {
+    io = links[i];
+    if (!hi_pin(hit, io))
+      continue;  /* link is being closed */
+    if (io->qel.proto == S5066_DTS && io->ad.dts)  /* else slot was reused meanwhile */
+      dts_sched_queue(hit, io, req, len, d, expedited ? DTS_CLASS_EXPEDITED : priority,
+		      tx_mode == 1, MAX(n_re_tx, 1));  /* always at least once */
+    hi_unpin(hit, io);
   }
 }
 
 /* ================== DECODING DTS PRIMITIVES ================== */
 
+/* Compare data CRC, as computed by caller over seg_size bytes at c_pdu, to the one in D_PDU. */
+
+static int dts_bad_crc32(struct hi_pdu* req, int seg_size, unsigned int data_crc32)
+{
+  unsigned char* p_crc = (unsigned char*)(req->ad.dts.c_pdu + seg_size);
+  if (p_crc[0] == ((data_crc32 >> 24) & 0x00ff)
+      && p_crc[1] == ((data_crc32 >> 16) & 0x00ff)
+      && p_crc[2] == ((data_crc32 >> 8) & 0x00ff)
+      && p_crc[3] == (data_crc32 & 0x00ff))
+    return 0;
+  ++req->fe->ad.dts->n_crc_err;
+  ERR("Bad DTS PDU. fd(%x) op(%x) body CRC check failed: data_crc(0x%02x%02x%02x%02x) calculated(0x%08x) n_crc_err(%d)",
+      req->fe->fd, req->m[2], p_crc[0], p_crc[1], p_crc[2], p_crc[3], data_crc32, req->fe->ad.dts->n_crc_err);
+  return 1;
+}
+
+/* Count how many bytes of range from..to-1 are marked received in the
+ * reassembly map. If set, also mark them. Works a 64 bit word at a time. */
+
+static int dts_rx_map(unsigned long long* map, int from, int to, int set)
+{
+  unsigned long long mask;
+  int n = 0, w, last;
+  if (from >= to)
+    return 0;
+  last = (to - 1) >> 6;
+  for (w = from >> 6; w <= last; ++w) {
+    mask = ~0ULL;
+    if (w == from >> 6)
+      mask &= ~0ULL << (from & 63);
+    if (w == last)
+      mask &= ~0ULL >> (63 - ((to - 1) & 63));
+    n += __builtin_popcountll(map[w] & mask);
+    if (set)
+      map[w] |= mask;
+  }
+  return n;
+}
+
+/* Ship a complete C_PDU to the SIS layer. The C_PDU, c_pdu_len bytes, starts at
+ * pdu->m + SIS_UNIDATA_IND_MIN_HDR - 4 so that the S_UNIDATA_INDICATION header can
+ * be formulated in front of it. req is the D_PDU that completed it, for addresses.
+ * Expedited data goes up as S_EXPEDITED_UNIDATA_INDICATION, which is the same
+ * but for priority and the block counts at the end. */
+
+static void dts_deliver(struct hi_thr* hit, struct hi_pdu* pdu, int c_pdu_len, struct hi_pdu* req, int addr_size, int expedited)
+{
+  struct hi_io* io;
+  int u_len, sap, s_len, hdr_len = expedited ? SIS_UNIDATA_IND_MIN_HDR - 4 : SIS_UNIDATA_IND_MIN_HDR;
+  char* c_pdu = pdu->m + SIS_UNIDATA_IND_MIN_HDR - 4;
+  char* h;
+  
+  HEXDUMP("C_PDU: ", c_pdu, c_pdu + c_pdu_len, 500);
+  
+  sap = c_pdu[2] & 0x0f; /* destination SAP ID */
+  s_len = c_pdu[3] & 0x40 ? 6 : 4;  /* TTD is present, or not and layout shifts */
+  u_len = c_pdu_len - s_len;
+  h = c_pdu + s_len - hdr_len;
+  
+  h[0] = 0x90;  /* Maury-Styles */
+  h[1] = 0xeb;
+  h[2] = 0x00;  /* Version */
+  h[3] = ((hdr_len - 5 + u_len) >> 8) & 0x00ff;
+  h[4] = (hdr_len - 5 + u_len) & 0x00ff;
+  if (expedited) {
+    h[5] = S_EXPEDITED_UNIDATA_INDICATION;
+    h[6] = c_pdu[2] & 0x0f;  /* DEST SAP ID */
+  } else {
+    h[5] = S_UNIDATA_INDICATION;
+    h[6] = (c_pdu[1] << 4) & 0xf0 | c_pdu[2] & 0x0f;  /* PRIO and DEST SAP ID */
+  }
+  dts_dec_two_addr(addr_size, req->m + 6, h+7, h+12);
+  h[11] = 0x00 | (c_pdu[2] >> 4) & 0x0f;  /* TX Mode and SRC SAP ID */
+  h[16] = (u_len >> 8) & 0x00ff;
+  h[17] = u_len & 0x00ff;
+  if (!expedited) {
+    h[18] = h[19] = 0; /* Number of Errored Blocks (none) */
+    h[20] = h[21] = 0; /* Number of Non Received Blocks (none) */
+  }
+  
+  /* Lock free, see struct sis_sap. Once pinned, io can not be closed and reused
+   * by another connection, so if it is still the client, it stays one for the send. */
+  if ((io = saptab[sap].io) && hi_pin(hit, io)) {
+    if (saptab[sap].io == io) {
+      D("deliver %sUNIDATA_IND from DTS sap(%d) to sis fd(%x) u_len=%d", expedited ? "EXPEDITED_" : "", sap, io->fd, u_len);
+      hi_send1(hit, io, 0, pdu, hdr_len + u_len, h);
+    } else {
+      D("SIS client of sap(%d) went away", sap);
+      hi_pdu_free(hit, pdu);
+    }
+    hi_unpin(hit, io);
+  } else {
+    ERR("Can not deliver UNIDATA_IND from DTS: No SIS client bound with sapid(%d)", sap);
+    hi_pdu_free(hit, pdu);
+  }
+}
+
+/* Take a snapshot of our rx_lwe and bitmap of D_PDUs held beyond it (C.3.4) for the
+ * next D_PDU written to carry, see dts_late_bind(). An ACK-ONLY is queued if
+ * ack_now is set, or enough D_PDUs went unacked, unless one is queued already.
+ * Should any DATA D_PDU get written first, it carries the ACK and the ACK-ONLY
+ * is dropped. Expedited data is only acked by EACK-ONLY. Called with dts->mut held. */
+
+static void dts_arq_ack_due(struct hi_thr* hit, struct hi_io* io, struct dts_chan* ch, int ack_now)
+{
+  struct dts_conn* dts = io->ad.dts;
+  struct hi_pdu* resp;
+  int i, send = 0;
+  
+  LOCK(dts->ack_mut, "ack snap");
+  ch->ack[0] = ch->rx_lwe;
+  memset(ch->ack + 1, 0, sizeof(ch->ack) - 1);
+  ch->ack_len = 0;
+  for (i = 0; i < DTS_ARQ_WIN - 1; ++i)
+    if (ch->rx_pdus[(ch->rx_lwe + 1 + i) & 0xff]) {
+      SET_BIT(ch->ack + 1, i, 1);
+      ch->ack_len = (i >> 3) + 1;
+    }
+  if ((++ch->ack_due >= DTS_ARQ_ACK_EVERY || ack_now) && !ch->ack_queued)
+    send = ch->ack_queued = 1;
+  UNLOCK(dts->ack_mut, "ack snap");
+  
+  if (send) {  /* header is filled in by dts_late_bind() */
+    resp = dts_encode_start(hit, ch->expedited ? DTS_EACK_ONLY : DTS_ACK_ONLY, 0,
+			    dts->remote_station_addr, DTS_MIN_PDU_SIZE - 2 + 1);
+    hi_send(hit, io, 0, resp);
+  }
+}
+
+/* Append the segment of an in order D_PDU to the C_PDU being reassembled. */
+
+static void dts_arq_rx_seg(struct hi_thr* hit, struct hi_io* io, struct dts_chan* ch, struct hi_pdu* req, int addr_size)
+{
+  struct hi_pdu* pdu = ch->rx_c_pdu;
+  int flags = DTS_SHB(req, addr_size, 0);
+  int seg_size = DTS_SEG_C_PDU_SIZE(req, addr_size);
+  
+  if (flags & DTS_F_START) {
+    if (pdu) {
+      D("C_PDU without END, dropping len(%d)", pdu->len);
+      hi_pdu_free(hit, pdu);
+    }
+    pdu = ch->rx_c_pdu = hi_pdu_alloc(hit, SIS_UNIDATA_IND_MIN_HDR - 4 + DTS_MAX_C_PDU);
+    if (!pdu) {
+      ERR("Out of PDUs, dropping C_PDU at tx_seq(%d)", DTS_SHB(req, addr_size, 2));
+      return;
+    }
+    pdu->len = 0;
+  }
+  if (!pdu) {
+    D("Segment without C_PDU START, dropping tx_seq(%d)", DTS_SHB(req, addr_size, 2));
+    return;
+  }
+  if (pdu->len + seg_size > DTS_MAX_C_PDU) {
+    ERR("C_PDU too long(%d), dropping", pdu->len + seg_size);
+    hi_pdu_free(hit, pdu);
+    ch->rx_c_pdu = 0;
+    return;
+  }
+  memcpy(pdu->m + SIS_UNIDATA_IND_MIN_HDR - 4 + pdu->len, req->ad.dts.c_pdu, seg_size);
+  pdu->len += seg_size;
+  if (flags & DTS_F_END) {
+    ch->rx_c_pdu = 0;
+    dts_deliver(hit, pdu, pdu->len, req, addr_size, ch->expedited);
+  }
+}
+
+/* Receive DATA-ONLY, DATA-ACK, or EDATA-ONLY D_PDU. In sequence D_PDUs are
+ * reassembled right away, followed by any held ones that thus became in
+ * sequence. Others within the window are held in rx_pdus[] (which takes a
+ * reference, see dts_decode()). Called with dts->mut held. */
+
+static void dts_arq_rx(struct hi_thr* hit, struct hi_io* io, struct dts_chan* ch, struct hi_pdu* req, int addr_size)
+{
+  struct hi_pdu* pdu;
+  int seq = DTS_SHB(req, addr_size, 2) & 0xff;
+  int off = (seq - ch->rx_lwe) & 0xff;
+  int flags = DTS_SHB(req, addr_size, 0);
+  int c_off;
+  
+  if (off >= DTS_ARQ_WIN || ch->rx_pdus[seq]) {
+    D("ARQ duplicate tx_seq(%d) rx_lwe(%d)", seq, ch->rx_lwe);
+    dts_arq_ack_due(hit, io, ch, 1);  /* our previous ACK was probably lost */
+    return;
+  }
+  if (off) {
+    c_off = req->ad.dts.c_pdu - req->m;
+    hi_pdu_unshare(hit, req);  /* held for up to a round trip, see rx_pdus[] */
+    req->ad.dts.c_pdu = req->m + c_off;
+    req->ad.dts.addr_len = addr_size;
+    req->fe = 0;        /* not in reqs, see hi_pdu_release() */
+    hi_pdu_hold(req);
+    ch->rx_pdus[seq] = req;
+  } else {
+    dts_arq_rx_seg(hit, io, ch, req, addr_size);
+    ch->rx_lwe = (ch->rx_lwe + 1) & 0xff;
+    while ((pdu = ch->rx_pdus[ch->rx_lwe])) {
+      ch->rx_pdus[ch->rx_lwe] = 0;
+      dts_arq_rx_seg(hit, io, ch, pdu, pdu->ad.dts.addr_len);
+      flags |= DTS_SHB(pdu, pdu->ad.dts.addr_len, 0);
+      hi_pdu_release(hit, pdu);
+      ch->rx_lwe = (ch->rx_lwe + 1) & 0xff;
+    }
+  }
+  dts_arq_ack_due(hit, io, ch, flags & (DTS_F_UWE | DTS_F_END));
+}
+
+/* Late binding of D_PDU header fields, called from hi_make_iov() just before
+ * writev(2). remaining is the number of bytes in the writev(2) from this D_PDU
+ * onwards, for EOT. ARQ data carries any ACK that is due as DATA-ACK. The header
+ * CRC is recomputed. Returns 0 if the D_PDU should not be sent at all, i.e. an
+ * ACK-ONLY (or EACK-ONLY) whose ACK already went out on a later D_PDU. */
+
+int dts_late_bind(struct hi_io* io, struct hi_pdu* pdu, int remaining)
+{
+  struct dts_conn* dts = io->ad.dts;
+  char* m = pdu->m;
+  int addr_len = (m[5] >> 5) & 0x07;
+  int hdr_len = m[5] & 0x1f;
+  char* h = m + DTS_MIN_PDU_SIZE + addr_len;
+  struct dts_chan* ch;
+  unsigned short hdr_crc16;
+  long long now, drain;
+  int win, len, i;
+  
+  ASSERTOP(pdu->iov[0].iov_base, ==, m);
+  
+  switch ((m[2] >> 4) & 0x0f) {
+  case DTS_DATA_ONLY:
+  case DTS_DATA_ACK:
+    ch = &dts->ch[DTS_CH_NORMAL];
+    LOCK(dts->ack_mut, "bind data");
+    if (ch->ack_due) {
+      m[2] = (DTS_DATA_ACK << 4) & 0xf0 | m[2] & 0x0f;
+      h[3] = ch->ack[0];
+      memcpy(h + 4, ch->ack + 1, ch->ack_len);
+      hdr_len = DTS_MIN_PDU_SIZE - 2 + 4 + ch->ack_len;
+      ch->ack_due = 0;
+    } else {
+      m[2] = (DTS_DATA_ONLY << 4) & 0xf0 | m[2] & 0x0f;
+      hdr_len = DTS_MIN_PDU_SIZE - 2 + 3;
+    }
+    UNLOCK(dts->ack_mut, "bind data");
+    break;
+  case DTS_ACK_ONLY:
+  case DTS_EACK_ONLY:
+    ch = &dts->ch[(m[2] >> 4 & 0x0f) == DTS_EACK_ONLY ? DTS_CH_EXPEDITED : DTS_CH_NORMAL];
+    LOCK(dts->ack_mut, "bind ack");
+    ch->ack_queued = 0;
+    if (!ch->ack_due) {
+      UNLOCK(dts->ack_mut, "bind ack");
+      D("ACK-ONLY dropped, ACK already went out on later D_PDU %d", io->fd);
+      return 0;
+    }
+    h[0] = ch->ack[0];
+    memcpy(h + 1, ch->ack + 1, ch->ack_len);
+    hdr_len = DTS_MIN_PDU_SIZE - 2 + 1 + ch->ack_len;
+    ch->ack_due = 0;
+    UNLOCK(dts->ack_mut, "bind ack");
+    D("ARQ ack rx_lwe(%d) ack_len(%d) exp(%d)", h[0] & 0xff, hdr_len - (DTS_MIN_PDU_SIZE - 2 + 1), ch->expedited);
+    break;
+  case DTS_NONARQ:  /* C_PDU reception window: time to send rest of C_PDU, in half seconds */
+  case DTS_ENONARQ:
+    win = MIN(((long long)pdu->ad.dts.c_pdu_rest * 16 + dts->bps - 1) / dts->bps, 0xffff);
+    h[7] = (win >> 8) & 0x00ff;
+    h[8] = win & 0x00ff;
+    break;
+  }
+  
+  m[5] = addr_len << 5 | hdr_len & 0x001f;
+  pdu->iov[0].iov_len = 2 + hdr_len + addr_len + 2;
+  
+  /* EOT, in half seconds. A paced link knows how much the modem still has to
+   * send from earlier writes, otherwise only this writev(2) is counted. */
+  for (len = i = 0; i < pdu->n_iov; ++i)
+    len += pdu->iov[i].iov_len;
+  remaining = MAX(remaining, len);  /* headers may have grown since it was counted */
+  if (dts->paced) {
+    now = hi_now_us();
+    LOCK(dts->ack_mut, "bind pace");
+    dts->tx_clear = MAX(dts->tx_clear, now) + DTS_TX_USEC(len, dts->bps);
+    drain = dts->tx_clear - now;
+    UNLOCK(dts->ack_mut, "bind pace");
+    drain += DTS_TX_USEC(remaining - len, dts->bps);
+    m[4] = MIN((drain + 499999) / 500000, 0xff);
+  } else
+    m[4] = MIN((remaining * 16 + dts->bps - 1) / dts->bps, 0xff);
+  
+  hdr_crc16 = CRC_16_S5066_batch(m + 2, h + hdr_len - (DTS_MIN_PDU_SIZE - 2));
+  h[hdr_len - (DTS_MIN_PDU_SIZE - 2)] = (hdr_crc16 >> 8) & 0x00ff;
+  h[hdr_len - (DTS_MIN_PDU_SIZE - 2) + 1] = hdr_crc16 & 0x00ff;
+  return 1;
+}
+
+/* ================== NONARQ reassembly ================== */
+
+/* C_PDUs are reassembled from NONARQ D_PDUs in a small open addressing table
+ * per channel, keyed by the 12 bit C_PDU ID. IDs are handed out in sequence, so
+ * they hash to consecutive slots. A C_PDU that has not completed dts_nonarq_ttl
+ * seconds after its first segment arrived is dropped, as is the oldest one
+ * when the table is full, so lost segments do not pin PDUs for ever, nor does
+ * a reused C_PDU ID pick up stale data. Once delivered, the slot is kept until
+ * it expires so that repeats of the C_PDU are not delivered again.
+ * Caller holds dts->mut. */
+
+static struct dts_reasm* dts_nonarq_slot(struct dts_chan* ch, int c_pdu_id)
+{
+  int i = c_pdu_id & (DTS_NONARQ_SLOTS - 1);
+  for (;; i = (i + 1) & (DTS_NONARQ_SLOTS - 1))
+    if (ch->nonarq[i].c_pdu_id == -1 || ch->nonarq[i].c_pdu_id == c_pdu_id)
+      return &ch->nonarq[i];
+}
+
+/* Free slot r. Entries that probed past it are moved back so that lookups
+ * need no tombstones. */
+
+static void dts_nonarq_drop(struct hi_thr* hit, struct dts_chan* ch, struct dts_reasm* r)
+{
+  int i = r - ch->nonarq, j, home;
+  if (r->pdu)
+    hi_pdu_free(hit, r->pdu);
+  --ch->n_nonarq;
+  for (j = (i + 1) & (DTS_NONARQ_SLOTS - 1); ch->nonarq[j].c_pdu_id != -1; j = (j + 1) & (DTS_NONARQ_SLOTS - 1)) {
+    home = ch->nonarq[j].c_pdu_id & (DTS_NONARQ_SLOTS - 1);
+    if (((j - home) & (DTS_NONARQ_SLOTS - 1)) >= ((j - i) & (DTS_NONARQ_SLOTS - 1))) {
+      ch->nonarq[i] = ch->nonarq[j];
+      i = j;
+    }
+  }
+  ch->nonarq[i].c_pdu_id = -1;
+  ch->nonarq[i].pdu = 0;
+}
+
+/* Drop expired C_PDUs of both channels and arrange a wake up for the next
+ * one to expire, so that an idle link gets cleaned up, too. */
+
+static void dts_nonarq_expire(struct hi_thr* hit, struct hi_io* io)
+{
+  struct dts_conn* dts = io->ad.dts;
+  struct dts_chan* ch;
+  struct dts_reasm* r;
+  time_t now = time(0), next = 0;
+  for (ch = dts->ch; ch < dts->ch + DTS_N_CH; ++ch)
+    for (r = ch->nonarq; r < ch->nonarq + DTS_NONARQ_SLOTS; ) {
+      if (r->c_pdu_id == -1) {
+	++r;
+	continue;
+      }
+      if (r->expire <= now) {
+	if (r->pdu)
+	  D("NONARQ c_pdu_id(%x) expired, missing %d of %d", r->c_pdu_id, r->pdu->ad.dtsrx.missing, r->pdu->len);
+	dts_nonarq_drop(hit, ch, r);
+	continue;  /* some other entry may have moved to r */
+      }
+      if (!next || r->expire < next)
+	next = r->expire;
+      ++r;
+    }
+  dts->nonarq_exp = next;
+  if (next)
+    hi_wake_at(io, next * 1000000LL);
+}
+
+/* Find C_PDU c_pdu_id of c_pdu_size bytes for reassembly, starting it if it
+ * is new. Returns 0 if it was delivered already, or no PDU is available. */
+
+static struct dts_reasm* dts_nonarq_find(struct hi_thr* hit, struct hi_io* io, struct dts_chan* ch, int c_pdu_id, int c_pdu_size)
+{
+  struct dts_conn* dts = io->ad.dts;
+  struct dts_reasm* r = dts_nonarq_slot(ch, c_pdu_id);
+  struct dts_reasm* old;
+  struct hi_pdu* pdu;
+  
+  if (r->c_pdu_id != -1) {
+    if (!r->pdu) {
+      D("Repeat of delivered c_pdu_id(%x)", c_pdu_id);
+      return 0;
+    }
+    if (r->pdu->len == c_pdu_size)
+      return r;
+    D("c_pdu_id(%x) reused: orig_len(%x) got c_pdu_size(%x), dropping stale", c_pdu_id, r->pdu->len, c_pdu_size);
+    dts_nonarq_drop(hit, ch, r);
+  } else if (ch->n_nonarq >= DTS_NONARQ_MAX) {
+    for (old = r = ch->nonarq; r < ch->nonarq + DTS_NONARQ_SLOTS; ++r)
+      if (r->c_pdu_id != -1 && (old->c_pdu_id == -1 || r->expire < old->expire))
+	old = r;
+    D("NONARQ table full, dropping c_pdu_id(%x)", old->c_pdu_id);
+    dts_nonarq_drop(hit, ch, old);
+  }
+  
+  /* SIS header, C_PDU, and the word aligned rx map after it */
+  pdu = hi_pdu_alloc(hit, SIS_UNIDATA_IND_MIN_HDR - 4 + c_pdu_size + 7 + ((c_pdu_size + 63) >> 6) * 8);
+  if (!pdu) {
+    ERR("Out of PDUs, dropping c_pdu_id(%x) size(%d)", c_pdu_id, c_pdu_size);
+    return 0;
+  }
+  pdu->len = c_pdu_size;
+  pdu->ad.dtsrx.rx_map = (unsigned long long*)
+    (((long)(pdu->m + SIS_UNIDATA_IND_MIN_HDR - 4 + c_pdu_size) + 7) & ~7L);
+  memset(pdu->ad.dtsrx.rx_map, 0, ((c_pdu_size + 63) >> 6) * 8);
+  pdu->ad.dtsrx.missing = c_pdu_size;
+  
+  r = dts_nonarq_slot(ch, c_pdu_id);  /* drops above may have moved the free slot */
+  r->c_pdu_id = c_pdu_id;
+  r->expire = time(0) + dts_nonarq_ttl;
+  r->pdu = pdu;
+  ++ch->n_nonarq;
+  if (!dts->nonarq_exp || r->expire < dts->nonarq_exp) {
+    dts->nonarq_exp = r->expire;
+    hi_wake_at(io, r->expire * 1000000LL);
+  }
+  return r;
+}
+
+/* Receive NONARQ or ENONARQ D_PDU. Caller holds dts->mut. */
+
+static int dts_nonarq_rx(struct hi_thr* hit, struct hi_io* io, struct dts_chan* ch, struct hi_pdu* req, int addr_size)
+{
+  int have, c_pdu_id, c_pdu_size, c_pdu_offset, c_pdu_rx_win;
+  int seg_size = DTS_SEG_C_PDU_SIZE(req, addr_size);
+  struct dts_reasm* r;
+  struct hi_pdu* pdu;
+  char* c_pdu;
+  
+  c_pdu_id = (DTS_SHB(req, addr_size, 0) << 4) & 0x0f00 | DTS_SHB(req, addr_size, 2) & 0x00ff;
+  c_pdu_size   = (DTS_SHB(req, addr_size, 3) << 8) & 0xff00 | DTS_SHB(req, addr_size, 4) & 0x0ff;
+  c_pdu_offset = (DTS_SHB(req, addr_size, 5) << 8) & 0xff00 | DTS_SHB(req, addr_size, 6) & 0x0ff;
+  c_pdu_rx_win = (DTS_SHB(req, addr_size, 7) << 8) & 0xff00 | DTS_SHB(req, addr_size, 8) & 0x0ff;
+  D("DTS_%sNONARQ seg_c_pdu_size(0x%x) flags(%x) c_pdu_id(%x) c_pdu_size(0x%x) c_pdu_seg_offset(0x%x) c_pdu_rx_win(0x%x)",
+    ch->expedited ? "E" : "", seg_size, DTS_SHB(req, addr_size, 0), c_pdu_id, c_pdu_size, c_pdu_offset, c_pdu_rx_win);
+  
+  if (c_pdu_offset + seg_size > c_pdu_size) {
+    D("INSANITY: c_pdu_offset(%d) + seg_size(%d) exceed c_pdu_size(%d)", c_pdu_offset, seg_size, c_pdu_size);
+    return 0;
+  }
+  
+  /* Need to assemble a complete C_PDU before we can pass off to upper layer. This may
+   * take time as segments may (a) arrive out of order, (b) arrive over several
+   * repeatitions, (c) arrive errornous or not at all. */
+  
+  if (!(r = dts_nonarq_find(hit, io, ch, c_pdu_id, c_pdu_size)))
+    return 0;
+  pdu = r->pdu;
+
+  /* Copy data to its place and color the map to indicate it was received. Data needs to
+   * be copied at right offset so that when converted to U_PDU over SIS interface,
+   * it will be in the right place, i.e. offset 19. The trick is to understand the
+   * size of S_PDU headers. This may be complicated because we may not receive
+   * the first segment first. The variable component of S_PDU is the TTD field.
+   * For now we simply assume the TTD is there and only adjust in the end, if not.
+   * Without TTD C_PDU+S_PDU header will take 4 bytes (would take 6 with TTD).
+   * For time being we do not support S_UNIDATA_INDICATION with errored and
+   * non-rd'd blocks descriptions (these would add yet another, potentially
+   * large, variable component to the header). */
+  
+  c_pdu = pdu->m + SIS_UNIDATA_IND_MIN_HDR - 4;
+  have = dts_rx_map(pdu->ad.dtsrx.rx_map, c_pdu_offset, c_pdu_offset + seg_size, 0);
+  if (have == seg_size) {
+    D("Duplicate segment c_pdu_id(%x) offset(%d) seg_size(%d)", c_pdu_id, c_pdu_offset, seg_size);
+    return 0;
+  }
+  if (!have) {
+    /* Nothing of this segment received yet: the data CRC is checked while
+     * copying, see dts_decode(). If it fails, the map is not colored. */
+    if (dts_bad_crc32(req, seg_size, CRC_32_S5066_copy(c_pdu + c_pdu_offset, req->ad.dts.c_pdu,
+						       req->ad.dts.c_pdu + seg_size)))
+      return 0;  /* segment is lost, a repeat may yet bring it */
+  } else {
+    /* Repeat: do not clobber good data with a segment that may yet fail CRC */
+    if (dts_bad_crc32(req, seg_size, CRC_32_S5066_batch(req->ad.dts.c_pdu, req->ad.dts.c_pdu + seg_size)))
+      return 0;
+    memcpy(c_pdu + c_pdu_offset, req->ad.dts.c_pdu, seg_size);
+  }
+  pdu->ad.dtsrx.missing -= seg_size - dts_rx_map(pdu->ad.dtsrx.rx_map, c_pdu_offset, c_pdu_offset + seg_size, 1);
+  if (pdu->ad.dtsrx.missing) {
+    D("PDU incomplete len=%d missing=%d", pdu->len, pdu->ad.dtsrx.missing);
+    return 0; /* PDU still incomplete */
+  }
+  /* Hurrah! PDU is compete. Ship it to the SIS layer. The pdu now belongs to
+   * the SIS write queue. The slot stays, so that repeats are dropped. */
+  r->pdu = 0;
+  dts_deliver(hit, pdu, pdu->len, req, addr_size, ch->expedited);
+  return 0;
+}
+
 /* Deal with data received from the pipe. Essentially we see segmented
  * c_pdus that need to be assembled and once complete, delivered
  * to the right SIS SAP. */
 
-int dts_data(struct hi_thr* hit, struct hi_pdu* req, int addr_size)
+int dts_data(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int addr_size)
 {
-  struct hi_io* io;
-  int i, c_pdu_id, c_pdu_size, c_pdu_offset, c_pdu_rx_win, u_len, sap;
+  struct dts_conn* dts = io->ad.dts;
   int d_type = (req->m[2] >> 4 & 0x0f);
   int seg_size = DTS_SEG_C_PDU_SIZE(req, addr_size);
-  struct hi_pdu* pdu;
-  char* c_pdu;
-  char* u_pdu;
-  char* h;
+  int ret;
   
   switch (d_type) {
   case DTS_DATA_ONLY:  /* 0 */
     D("DTS_DATA_ONLY seg_c_pdu_size(%d) flags(%x) tx_seq(%x)", seg_size, DTS_SHB(req, addr_size, 0), DTS_SHB(req, addr_size, 2));
+    LOCK(dts->mut, "arq rx");
+    dts_arq_rx(hit, io, &dts->ch[DTS_CH_NORMAL], req, addr_size);
+    UNLOCK(dts->mut, "arq rx");
     return 0;
   case DTS_DATA_ACK:   /* 2 */
     D("DTS_DATA_ACK seg_c_pdu_size(%d) flags(%x) tx_seq(%x) rx_lwe(%d)", seg_size, DTS_SHB(req, addr_size, 0), DTS_SHB(req, addr_size, 2), DTS_SHB(req, addr_size, 3));
+    LOCK(dts->mut, "arq rx ack");
+    dts_arq_ack(hit, io, &dts->ch[DTS_CH_NORMAL], DTS_SHB(req, addr_size, 3), &DTS_SHB(req, addr_size, 4),
+		(req->m[5] & 0x1f) - (DTS_MIN_PDU_SIZE - 2 + 4));
+    dts_arq_rx(hit, io, &dts->ch[DTS_CH_NORMAL], req, addr_size);
+    UNLOCK(dts->mut, "arq rx ack");
     return 0;
   case DTS_EDATA_ONLY: /* 4 */
     D("DTS_EDATA_ONLY seg_c_pdu_size(%d) flags(%x) tx_seq(%x)", seg_size, DTS_SHB(req, addr_size, 0), DTS_SHB(req, addr_size, 2));
+    LOCK(dts->mut, "earq rx");
+    dts_arq_rx(hit, io, &dts->ch[DTS_CH_EXPEDITED], req, addr_size);
+    UNLOCK(dts->mut, "earq rx");
     return 0;
   case DTS_NONARQ:     /* 7 */
-    c_pdu_id = DTS_SHB(req, addr_size, 2);
-    c_pdu_size   = (DTS_SHB(req, addr_size, 3) << 8) & 0xff00 | DTS_SHB(req, addr_size, 4) & 0x0ff;
-    c_pdu_offset = (DTS_SHB(req, addr_size, 5) << 8) & 0xff00 | DTS_SHB(req, addr_size, 6) & 0x0ff;
-    c_pdu_rx_win = (DTS_SHB(req, addr_size, 7) << 8) & 0xff00 | DTS_SHB(req, addr_size, 8) & 0x0ff;
-    D("DTS_NONARQ seg_c_pdu_size(0x%x) flags(%x) c_pdu_id(%x) c_pdu_size(0x%x) c_pdu_seg_offset(0x%x) c_pdu_rx_win(0x%x)",
-      seg_size, DTS_SHB(req, addr_size, 0), c_pdu_id, c_pdu_size, c_pdu_offset, c_pdu_rx_win);
-    
-    /* Need to assemble a complete C_PDU before we can pass off to upper layer. This may
-     * take time as segments may (a) arrive out of order, (b) arrive over several
-     * repeatitions, (c) arrive errornous or not at all. */
-    
-    pdu = req->fe->ad.dts->nonarq_pdus[c_pdu_id];
-    if (!pdu) {
-      pdu = hi_pdu_alloc(hit);
-      req->fe->ad.dts->nonarq_pdus[c_pdu_id] = pdu;
-      pdu->len = c_pdu_size;
-      memset(pdu->ad.dtsrx.rx_map, 0, sizeof(pdu->ad.dtsrx.rx_map));
-    } else {
-      if (pdu->len != c_pdu_size) {
-	D("INSANITY c_pdu_id(%x) size mismatch: orig_len(%x) got c_pdu_size(%x)", c_pdu_id, pdu->len, c_pdu_size);
-	return 0;
-      }
-    }
-    
-    if (c_pdu_offset + seg_size > pdu->len) {
-      D("INSANITY: c_pdu_offset(%d) + seg_size(%d) exceed pdu->len(%d)", c_pdu_offset, seg_size, pdu->len);
-      return 0;
-    }
-    
-    /* Copy data to its place and color the map to indicate it was received. Data needs to
-     * be copied at right offset so that when converted to U_PDU over SIS interface,
-     * it will be in the right place, i.e. offset 19. The trick is to understand the
-     * size of S_PDU headers. This may be complicated because we may not receive
-     * the first segment first. The variable component of S_PDU is the TTD field.
-     * For now we simply assume the TTD is there and only adjust in the end, if not.
-     * Without TTD C_PDU+S_PDU header will take 4 bytes (would take 6 with TTD).
-     * For time being we do not support S_UNIDATA_INDICATION with errored and
-     * non-rd'd blocks descriptions (these would add yet another, potentially
-     * large, variable component to the header). */
-    
-    c_pdu = pdu->m + SIS_UNIDATA_IND_MIN_HDR - 4;
-    memcpy(c_pdu + c_pdu_offset,  req->m + 6 + addr_size + 9 + 2,  seg_size);
-    for (i = c_pdu_offset; i < c_pdu_offset + seg_size; ++i)
-      SET_BIT(pdu->ad.dtsrx.rx_map, i, 1);
-    
-    /* Scan the map to see if C_PDU has been completely received */
-    
-    for (i = 0; i < pdu->len; ++i)
-      if (!GET_BIT(pdu->ad.dtsrx.rx_map, i)) {
-	D("PDU incomplete len=%d", pdu->len);
-	HEXDUMP("rx_map: ", pdu->ad.dtsrx.rx_map, pdu->ad.dtsrx.rx_map + (pdu->len >> 3) + 1, 32);
-	return 0; /* PDU still incomplete */
-      }
-    /* Hurrah! PDU is compete. Ship it to the SIS layer. First formulate SIS headers. */
-    HEXDUMP("C_PDU: ", c_pdu, c_pdu + c_pdu_size, 500);
-    
-    sap = c_pdu[2] & 0x0f; /* destination SAP ID */
-    if (c_pdu[3] & 0x40) { /* TTD is present */
-      h = pdu->m + 2;
-      u_len = pdu->len - 6;
-      u_pdu = c_pdu + 6;
-    } else {  /* No TTD, need to shift the layout */
-      h = pdu->m;
-      u_len = pdu->len - 4;
-      u_pdu = c_pdu + 4;
-    }
-    
-    h[0] = 0x90;  /* Maury-Styles */
-    h[1] = 0xeb;
-    h[2] = 0x00;  /* Version */
-    h[3] = ((SIS_UNIDATA_IND_MIN_HDR - 5 + u_len) >> 8) & 0x00ff;
-    h[4] = (SIS_UNIDATA_IND_MIN_HDR - 5 + u_len) & 0x00ff;
-    h[5] = S_UNIDATA_INDICATION;
-    h[6] = (c_pdu[1] << 4) & 0xf0 | c_pdu[2] & 0x0f;  /* PRIO and DEST SAP ID */
-    dts_dec_two_addr(addr_size, req->m + 6, h+7, h+12);
-    h[11] = 0x00 | (c_pdu[2] >> 4) & 0x0f;  /* TX Mode and SRC SAP ID */
-    h[16] = (u_len >> 8) & 0x00ff;
-    h[17] = u_len & 0x00ff;
-    h[18] = h[19] = 0; /* Number of Errored Blocks (none) */
-    h[20] = h[21] = 0; /* Number of Non Received Blocks (none) */
-  
-    LOCK(saptab_mut, "deliver to sis");
-    io = saptab[sap].io;
-    UNLOCK(saptab_mut, "deliver to sis");
-    if (io) {
-      D("deliver UNIDATA_IND from DTS sap(%d) to sis fd(%x) u_len=%d", sap, io->fd, u_len);
-      hi_send1(hit, io, 0, pdu, SIS_UNIDATA_IND_MIN_HDR + u_len, h);
-    } else {
-      ERR("Can not deliver UNIDATA_IND from DTS: No SIS client bound with sapid(%d)", sap);
-    }
-    return 0;
-    
   case DTS_ENONARQ:    /* 8 */
-    D("DTS_ENONARQ seg_c_pdu_size(%d) flags(%x) c_pdu_id(%x) c_pdu_size(0x%02x%02x) c_pdu_seg_offset(0x%02x%02x) c_pdu_rx_win(0x%02x%02x)",
-      seg_size, DTS_SHB(req, addr_size, 0), DTS_SHB(req, addr_size, 2),
-      DTS_SHB(req, addr_size, 3), DTS_SHB(req, addr_size, 4),
-      DTS_SHB(req, addr_size, 5), DTS_SHB(req, addr_size, 6),
-      DTS_SHB(req, addr_size, 7), DTS_SHB(req, addr_size, 8));
-    return 0;
+    LOCK(dts->mut, "nonarq rx");
+    ret = dts_nonarq_rx(hit, io, &dts->ch[d_type == DTS_ENONARQ ? DTS_CH_EXPEDITED : DTS_CH_NORMAL], req, addr_size);
+    UNLOCK(dts->mut, "nonarq rx");
+    return ret;
   default:            /* 9-14 reserved */
     NEVERNEVER("bad d_type(%x)", d_type);
   }
@@ -481,8 +1257,6 @@ static int dts_process_hdr(struct hi_thr* hit, struct hi_io* io, struct hi_pdu*
 {
   int size;
   int d_type = (req->m[2] >> 4 & 0x0f);
-  int eow = (req->m[2] << 8) | req->m[3];
-  int eot = req->m[4];
   switch (d_type) {
   case DTS_DATA_ONLY:  /* 0 */
     if (hdr_size != (DTS_MIN_PDU_SIZE + 3 - 2)) goto bad;
@@ -546,75 +1320,119 @@ static int dts_process_hdr(struct hi_thr* hit, struct hi_io* io, struct hi_pdu*
   return -1;
 }
 
+/* Hunt for the next Maury-Styles preamble in the bytes read, starting at offset
+ * from, and discard the junk before it by advancing req->m. Nothing is copied:
+ * should the D_PDU not fit in what remains of the buffer, hi_read() grows it,
+ * see hi_pdu_grow(). A 0x90 0xeb found in junk is only taken to be a D_PDU
+ * once its header CRC checks, see dts_decode(). */
+
+static void dts_resync(struct hi_io* io, struct hi_pdu* req, int from)
+{
+  struct dts_conn* dts = io->ad.dts;
+  char* p = req->m + from;
+  int n;
+  while ((p = memchr(p, 0x90, req->ap - p)) && p + 1 < req->ap && p[1] != (char)0xeb)
+    ++p;
+  if (!p)
+    p = req->ap;
+  n = p - req->m;
+  dts->n_junk += n;
+  D("fd(%x) discarded %d bytes hunting for preamble, junk(%d) hdr_crc_err(%d) crc_err(%d)",
+    io->fd, n, dts->n_junk, dts->n_hdr_crc_err, dts->n_crc_err);
+  req->m = p;  /* the read buffer may be shared, see hi_checkmore() */
+  req->need = DTS_MIN_PDU_SIZE;
+}
+
+/* Decode D_PDU from the bytes read. On an errorful channel, which is what HF is,
+ * a bad preamble or header CRC makes us hunt for the next preamble, and a D_PDU
+ * whose data CRC fails is dropped, see dts_bad_crc32(). The link stays up. */
+
 int dts_decode(struct hi_thr* hit, struct hi_io* io)
 {
-  int addr_size, hdr_size, seg_c_pdu_size;
+  int ret, addr_size, hdr_size, seg_c_pdu_size, d_type;
+  unsigned int key;
+  char to[4], from[4];
   unsigned short hdr_crc16;
-  unsigned int data_crc32;
   unsigned char* p_crc;
   struct hi_pdu* req = io->cur_pdu;
   int n = req->ap - req->m;
   
   if (n < DTS_MIN_PDU_SIZE) {   /* too little, need more */
-    req->need = DTS_MIN_PDU_SIZE - n;
+    req->need = DTS_MIN_PDU_SIZE;
     return 0;
   }
   
   if (req->m[0] != (char)0x90 || req->m[1] != (char)0xeb) { /* 16 bit Maury-Styles */
-    ERR("Bad DTS PDU. fd(%x) need 0x90eb preamble", io->fd);
     HEXDUMP("bad preamble: ", req->m, req->m + DTS_MIN_PDU_SIZE, 50);
-    /* *** Change this to scan for occurance of Maury-Styles and discard any junk before it,
-     * afterall, we are expecting an errorful channel. */
-    return HI_CONN_CLOSE;
+    dts_resync(io, req, 1);
+    return 0;
   }
   
   addr_size = (req->m[5] >> 5) & 0x07;
   hdr_size = req->m[5] & 0x1f;
-  req->len = 2 + addr_size + hdr_size;
+  req->len = 2 + addr_size + hdr_size + 2;  /* preamble, header, and header CRC */
   if (n < req->len) {                    /* Need more to complete header */
-    req->need = req->len - n;
+    req->need = req->len;
     return 0;
   }
   
   p_crc = (unsigned char*)(req->m + 2 + hdr_size + addr_size);
   hdr_crc16 = CRC_16_S5066_batch(req->m + 2, p_crc);
   if (p_crc[0] != ((hdr_crc16 >> 8) & 0x00ff) || p_crc[1] != (hdr_crc16 & 0x00ff)) {
+    ++io->ad.dts->n_hdr_crc_err;
     ERR("Bad DTS PDU. fd(%x) op(%x) header CRC check failed: hdr_crc(0x%02x%02x) calculated(0x%04x) hdr_size=%d addr_size=%d",
 	io->fd, req->m[2], p_crc[0], p_crc[1], hdr_crc16, hdr_size, addr_size);
-    /* *** Change this to scan for occurance of Maury-Styles and discard any junk before it,
-     * afterall, we are expecting an errorful channel. */
-    return HI_CONN_CLOSE;
+    dts_resync(io, req, 2);  /* this preamble was false, or the header got hit */
+    return 0;
   }
   
+  /* Learn route to the sending station, but only from D_PDUs to us (see -me) or
+   * broadcast: on a shared HF channel we also hear stations talk to each other,
+   * and our ACKs must not follow them, see dts_arq_ack_due(). D_PDU addresses
+   * carry no group flag, so a D_PDU to a group is not told apart from one to
+   * another station. It is still processed, but teaches nothing. */
+  dts_dec_two_addr(addr_size, req->m + 6, to, from);
+  key = dts_addr_key(to);
+  if ((key == DTS_ADDR_ALL || key == (dts_addr_key(my_station_addr) & DTS_ADDR_ALL))
+      && memcmp(from, io->ad.dts->remote_station_addr, 4)) {
+    memcpy(io->ad.dts->remote_station_addr, from, 4);
+    dts_route_learn(io, from);
+  }
+  
+  d_type = (req->m[2] >> 4) & 0x0f;
   seg_c_pdu_size = dts_process_hdr(hit, io, req, addr_size, hdr_size);
   if (seg_c_pdu_size == -1) {
     hi_checkmore(hit, io, req, DTS_MIN_PDU_SIZE);
+    if (d_type == DTS_ACK_ONLY || d_type == DTS_EACK_ONLY) {
+      LOCK(io->ad.dts->mut, "arq ack");
+      dts_arq_ack(hit, io, &io->ad.dts->ch[d_type == DTS_EACK_ONLY ? DTS_CH_EXPEDITED : DTS_CH_NORMAL],
+		  DTS_SHB(req, addr_size, 0), &DTS_SHB(req, addr_size, 1),
+		  hdr_size - (DTS_MIN_PDU_SIZE - 2 + 1));
+      UNLOCK(io->ad.dts->mut, "arq ack");
+    }
     hi_free_req(hit, req);
     return 0;
   }
    
   req->len += seg_c_pdu_size + 4;
   if (n < req->len) {                    /* Need more to complete data */
-    req->need = req->len - n;
+    req->need = req->len;
     return 0;
   }
   
+  req->fe = io;
   req->ad.dts.c_pdu = p_crc + 2;
-  p_crc = (unsigned char*)(req->ad.dts.c_pdu +  seg_c_pdu_size);
-  data_crc32 = CRC_32_S5066_batch(req->ad.dts.c_pdu, p_crc);
-  if (p_crc[0] != ((data_crc32 >> 24) & 0x00ff)
-      || p_crc[1] != ((data_crc32 >> 16) & 0x00ff)
-      || p_crc[2] != ((data_crc32 >> 8) & 0x00ff)
-      || p_crc[3] != (data_crc32 & 0x00ff)) {
-    ERR("Bad DTS PDU. fd(%x) op(%x) body CRC check failed: data_crc(0x%02x%02x%02x%02x) calculated(0x%08x)",
-	io->fd, req->m[2], p_crc[0], p_crc[1], p_crc[2], p_crc[3], data_crc32);
-    /* *** Need more graceful error handling afterall, we are expecting an errorful channel. */
-    return HI_CONN_CLOSE;
-  }
-  
   hi_checkmore(hit, io, req, DTS_MIN_PDU_SIZE);
-  hi_add_to_reqs(io, req);
-  return dts_data(hit, req, addr_size);
+  if (d_type != DTS_NONARQ && d_type != DTS_ENONARQ  /* NONARQ checks data CRC while copying */
+      && dts_bad_crc32(req, seg_c_pdu_size, CRC_32_S5066_batch(req->ad.dts.c_pdu, req->ad.dts.c_pdu + seg_c_pdu_size))) {
+    hi_free_req(hit, req);  /* ARQ: the sender resends what we do not ack */
+    return 0;
+  }
+
+  ret = dts_data(hit, io, req, addr_size);
+  if (!req->refs)  /* segment data has been copied to reassembly, or ARQ holds req */
+    hi_free_req(hit, req);
+  return ret;
 }
 
 /* EOF  --  dts.c */
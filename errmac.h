@@ -494,10 +494,10 @@ extern char* assert_msg;
 
 #define GET_NIBBLE(b, i)    ((i) & 0x01 ? (b)[(i)>>1] & 0x0f : ((b)[(i)>>1] >> 4) & 0x0f )
 #define SET_NIBBLE(b, i, v) ((i) & 0x01 ? ((b)[(i)>>1] = (b)[(i)>>1] & 0xf0 | (v) & 0x0f) \
-                                        : ((b)[(i)>>1] = (b)[(i)>>1] & 0x0f | ((v) << 4) & 0xf) )
+                                        : ((b)[(i)>>1] = (b)[(i)>>1] & 0x0f | ((v) << 4) & 0xf0) )
 
-#define GET_BIT(a,i)    ((a)[(i) >> 3] & (1 << ((i) & 0x3)))
-#define SET_BIT(a,i,v)  ((a)[(i) >> 3] = (v) ? ((a)[(i) >> 3] | (1 << ((i) & 0x3))) : ((a)[(i) >> 3] & ~(1 << ((i) & 0x3))))
+#define GET_BIT(a,i)    ((a)[(i) >> 3] & (1 << ((i) & 0x7)))
+#define SET_BIT(a,i,v)  ((a)[(i) >> 3] = (v) ? ((a)[(i) >> 3] | (1 << ((i) & 0x7))) : ((a)[(i) >> 3] & ~(1 << ((i) & 0x7))))
 
 /* -------------------------------------------------------- */
 /* BER and ASN.1 Macros */
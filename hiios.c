@@ -6,14 +6,20 @@
  *
  * See http://pl.atyp.us/content/tech/servers.html for inspiration on threading strategy.
  *
+ * The todo queue is an intrusive multi producer, single consumer list (after
+ * D. Vyukov). Producers atomically swap themselves into todo_produce and then
+ * link the previous element to themselves, so they never take a lock. The
+ * stub element keeps the list from ever becoming truly empty.
+ *
  *   MANY ELEMENTS IN QUEUE            ONE ELEMENT IN Q   EMPTY QUEUE
  *   consume             produce       consume  produce   consume  produce
- *    |                   |             | ,-------'         |        |
- *    V                   V             V V                 V        V
- *   qel.n --> qel.n --> qel.n --> 0   qel.n --> 0          0        0
+ *    |                   |             | ,-------'         | ,------'
+ *    V                   V             V V                 V V
+ *   qel.n --> qel.n --> qel.n --> 0   qel.n --> 0         stub.n --> 0
  */
 
 #ifdef LINUX
+#define _GNU_SOURCE        /* accept4(2) */
 #include <sys/epoll.h>     /* See man 4 epoll (Linux 2.6) */
 #endif
 #ifdef SUNOS
@@ -22,59 +28,319 @@
 #endif
 
 #include <pthread.h>
+#include <sched.h>
 #include <malloc.h>
 #include <memory.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#ifdef LINUX
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <linux/io_uring.h>  /* See man 7 io_uring (Linux 5.13) */
+#endif
 
 #include "afr.h"
 #include "hiios.h"
 #include "errmac.h"
 #include "s5066.h"
 
-struct hiios* hi_new_shuffler(int nfd, int npdu)
+extern int uring;
+
+#ifdef HAVE_IO_URING
+/* io_uring(7) backend, selected with -uring. Each fd has a multishot poll, whose
+ * completions drive the todo queue the way epoll events do, see hi_ur_reap().
+ * Writes are submitted as writev SQEs and the SQEs of all ios written while
+ * processing a todo item go to the kernel in one io_uring_enter(2), see
+ * hi_ur_submit(). The polling thread picks up completed writevs in hi_flush(),
+ * see hi_write(). Any thread may queue SQEs, under sq_mut. Only the
+ * thread holding the poll token reaps completions. No liburing: the rings are
+ * mapped by hand. */
+
+#define HI_UR_ENTRIES 256
+#define HI_UR_WRITE   1ULL                /* user_data: writev completion, not poll */
+#define HI_UR_PTR     0x0000fffffffffffeULL
+#define HI_UR_GEN(io) ((unsigned long long)((io)->ur_gen & 0x7fff) << 48)
+
+struct hi_uring {
+  int fd;
+  pthread_mutex_t sq_mut;
+  int to_submit;             /* SQEs queued but not yet handed to kernel */
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned cq_mask;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  struct io_uring_cqe* cqes;
+};
+
+static void hi_ur_init(struct hiios* shf)
 {
-  int i;
-  struct hiios* shf;
-  ZMALLOC(shf);
-  ZMALLOCN(shf->ios, sizeof(struct hi_io)*nfd);
-  shf->max_ios = nfd;
-  for (i = 0; i < nfd; ++i) {
-    pthread_mutex_init(&shf->ios[i].qel.mut, MUTEXATTR);
+  struct io_uring_params p;
+  struct hi_uring* ur;
+  char* sq;
+  int sq_sz, cq_sz;
+  ZMALLOC(ur);
+  memset(&p, 0, sizeof(p));
+  ur->fd = syscall(__NR_io_uring_setup, HI_UR_ENTRIES, &p);
+  if (ur->fd == -1) { ERR("io_uring_setup: %d %s", errno, STRERROR(errno)); exit(1); }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+    ERR("io_uring features(0x%x) lacking, -uring needs Linux 5.13 or newer", p.features);
+    exit(1);
   }
-  
-  ZMALLOCN(shf->pdus, sizeof(struct hi_pdu)*npdu);
-  shf->max_pdus = npdu;
-  for (i = npdu - 1; i; --i) {
-    shf->pdus[i-1].qel.n = (struct hi_qel*)(shf->pdus + i);
-    pthread_mutex_init(&shf->pdus[i].qel.mut, MUTEXATTR);
+  sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  sq = mmap(0, MAX(sq_sz, cq_sz), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    ur->fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) { ERR("mmap(io_uring rings): %d %s", errno, STRERROR(errno)); exit(1); }
+  ur->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+  if (ur->sqes == MAP_FAILED) { ERR("mmap(io_uring sqes): %d %s", errno, STRERROR(errno)); exit(1); }
+  ur->sq_head  = (unsigned*)(sq + p.sq_off.head);
+  ur->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+  ur->sq_mask  = *(unsigned*)(sq + p.sq_off.ring_mask);
+  ur->sq_entries = p.sq_entries;
+  ur->sq_array = (unsigned*)(sq + p.sq_off.array);
+  ur->cq_head  = (unsigned*)(sq + p.cq_off.head);
+  ur->cq_tail  = (unsigned*)(sq + p.cq_off.tail);
+  ur->cq_mask  = *(unsigned*)(sq + p.cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe*)(sq + p.cq_off.cqes);
+  pthread_mutex_init(&ur->sq_mut, MUTEXATTR);
+  shf->ur = ur;
+}
+
+/* Hand queued SQEs to kernel. Caller holds sq_mut. */
+
+static void hi_ur_submit0(struct hi_uring* ur)
+{
+  int n;
+  while (ur->to_submit) {
+    D("io_uring_enter(%x) submit %d", ur->fd, ur->to_submit);
+    n = syscall(__NR_io_uring_enter, ur->fd, ur->to_submit, 0, 0, 0, 0);
+    if (n == -1) {
+      if (errno == EINTR)
+	continue;
+      ERR("io_uring_enter(%x) submit %d: %d %s", ur->fd, ur->to_submit, errno, STRERROR(errno));
+      return;  /* e.g. EBUSY: completions must be reaped first, next submit retries */
+    }
+    ur->to_submit -= n;
   }
-  pthread_mutex_init(&shf->pdus[0].qel.mut, MUTEXATTR);
-  shf->free_pdus = shf->pdus;
-  pthread_mutex_init(&shf->pdu_mut, MUTEXATTR);
-  
+}
+
+void hi_ur_submit(struct hiios* shf)
+{
+  struct hi_uring* ur = shf->ur;
+  if (!ur->to_submit)
+    return;
+  LOCK(ur->sq_mut, "ur submit");
+  hi_ur_submit0(ur);
+  UNLOCK(ur->sq_mut, "ur submit");
+}
+
+/* Next free SQE, zeroed. hi_ur_push() makes it visible to kernel. Caller holds sq_mut. */
+
+static struct io_uring_sqe* hi_ur_sqe(struct hi_uring* ur)
+{
+  unsigned tail = *ur->sq_tail;
+  struct io_uring_sqe* sqe;
+  while (tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >= ur->sq_entries)
+    hi_ur_submit0(ur);  /* full: let kernel consume some */
+  sqe = &ur->sqes[tail & ur->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  ur->sq_array[tail & ur->sq_mask] = tail & ur->sq_mask;
+  return sqe;
+}
+
+static void hi_ur_push(struct hi_uring* ur)
+{
+  __atomic_store_n(ur->sq_tail, *ur->sq_tail + 1, __ATOMIC_RELEASE);
+  ++ur->to_submit;
+}
+
+/* Multishot poll, the counterpart of EPOLL_CTL_ADD with EPOLLET. Submitted right
+ * away as the poll thread may be waiting for completions. */
+
+static void hi_ur_poll_add(struct hiios* shf, int fd, struct hi_qel* qe, int events)
+{
+  struct hi_uring* ur = shf->ur;
+  struct io_uring_sqe* sqe;
+  LOCK(ur->sq_mut, "ur poll add");
+  sqe = hi_ur_sqe(ur);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = (uintptr_t)qe;
+  hi_ur_push(ur);
+  hi_ur_submit0(ur);
+  UNLOCK(ur->sq_mut, "ur poll add");
+}
+
+/* The poll holds a reference to the file, thus closing fd is not enough. */
+
+static void hi_ur_poll_del(struct hiios* shf, struct hi_io* io)
+{
+  struct hi_uring* ur = shf->ur;
+  struct io_uring_sqe* sqe;
+  LOCK(ur->sq_mut, "ur poll del");
+  sqe = hi_ur_sqe(ur);
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->addr = (uintptr_t)io;
+  sqe->user_data = 0;  /* completion is ignored */
+  hi_ur_push(ur);
+  hi_ur_submit0(ur);
+  UNLOCK(ur->sq_mut, "ur poll del");
+}
+
+/* Queue writev of io->iov_cur. Submitted once the todo item is done, see hi_shuffle(). */
+
+void hi_ur_writev(struct hi_io* io)
+{
+  struct hi_uring* ur = io->shf->ur;
+  struct io_uring_sqe* sqe;
+  D("writev sqe(%x) n_iov=%d", io->fd, io->n_iov);
+  io->ur_write = 1;
+  LOCK(ur->sq_mut, "ur writev");
+  sqe = hi_ur_sqe(ur);
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = io->fd;
+  sqe->addr = (uintptr_t)io->iov_cur;
+  sqe->len = io->n_iov;
+  sqe->user_data = (uintptr_t)io | HI_UR_GEN(io) | HI_UR_WRITE;
+  hi_ur_push(ur);
+  UNLOCK(ur->sq_mut, "ur writev");
+}
+#endif
+
+/* Set up the per shuffler (per shard) parts: poll set, todo queue, poll token, and
+ * the wake fd through which other threads can kick us out of epoll_wait(). */
+
+static void hi_init_poll(struct hiios* shf, int nfd)
+{
   pthread_cond_init(&shf->todo_cond, 0);
   pthread_mutex_init(&shf->todo_mut, MUTEXATTR);
+  shf->todo_consume = shf->todo_produce = &shf->todo_stub;
 
   shf->poll_tok.kind = HI_POLL;
   shf->poll_tok.proto = 1;       /* token is available */
+  shf->wake_qel.kind = HI_WAKE;
+  pthread_mutex_init(&shf->timer_mut, MUTEXATTR);
+  shf->tw_tick = hi_now_ms();
 
   shf->max_evs = MIN(nfd, 1024);
 #ifdef LINUX
+  shf->wake_fd[0] = shf->wake_fd[1] = eventfd(0, 0);
+  if (shf->wake_fd[0] == -1) { perror("eventfd"); exit(1); }
+  nonblock(shf->wake_fd[0]);
+#ifdef HAVE_IO_URING
+  if (uring) {
+    shf->ep = -1;
+    hi_ur_init(shf);
+    hi_ur_poll_add(shf, shf->wake_fd[0], &shf->wake_qel, EPOLLIN);
+    return;
+  }
+#endif
   shf->ep = epoll_create(nfd);
   if (shf->ep == -1) { perror("epoll"); exit(1); }
   ZMALLOCN(shf->evs, sizeof(struct epoll_event) * shf->max_evs);
+  {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &shf->wake_qel;
+    if (epoll_ctl(shf->ep, EPOLL_CTL_ADD, shf->wake_fd[0], &ev)) { perror("epoll_ctl(wake)"); exit(1); }
+  }
 #endif
 #ifdef SUNOS
   shf->ep = open("/dev/poll", O_RDWR);
   if (shf->ep == -1) { perror("open(/dev/poll)"); exit(1); }
   ZMALLOCN(shf->evs, sizeof(struct pollfd) * shf->max_evs);
+  if (pipe(shf->wake_fd)) { perror("pipe(wake)"); exit(1); }
+  nonblock(shf->wake_fd[0]);
+  nonblock(shf->wake_fd[1]);
+  {
+    struct pollfd pfd;
+    pfd.fd = shf->wake_fd[0];
+    pfd.events = POLLIN;
+    if (write(shf->ep, &pfd, sizeof(pfd)) == -1) { perror("write(/dev/poll, wake)"); exit(1); }
+  }
 #endif
+}
+
+/* nfd and npdu are ceilings. Both the fd table and the PDU pool start empty
+ * and grow on demand, see hi_io_slot() and hi_pdu_refill(). */
+
+struct hiios* hi_new_shuffler(int nfd, int npdu)
+{
+  struct hiios* shf;
+  ZMALLOC(shf);
+  shf->pool = shf;
+  shf->n_shards = 1;
+  pthread_mutex_init(&shf->ios_mut, MUTEXATTR);
+  shf->max_ios = nfd;
+  ZMALLOCN(shf->ios, sizeof(struct hi_io*) * ((nfd + HI_IO_CHUNK - 1) >> HI_IO_CHUNK_SHIFT));
+  
+  shf->max_pdus = npdu;
+  pthread_mutex_init(&shf->pdu_mut, MUTEXATTR);
+  
+  hi_init_poll(shf, nfd);
+  return shf;
+}
+
+/* Return io object for fd, allocating its chunk of the fd table if this is the
+ * first time an fd in that range is seen. Returns 0 if fd exceeds -nfd ceiling. */
+
+struct hi_io* hi_io_slot(struct hiios* shf, int fd)
+{
+  struct hiios* pool = shf->pool;
+  struct hi_io* chunk;
+  int i;
+  if (fd < 0 || fd >= pool->max_ios) {
+    ERR("fd(%x) exceeds -nfd %d", fd, pool->max_ios);
+    return 0;
+  }
+  if (!pool->ios[fd >> HI_IO_CHUNK_SHIFT]) {
+    LOCK(pool->ios_mut, "io_slot");
+    if (!pool->ios[fd >> HI_IO_CHUNK_SHIFT]) {
+      ZMALLOCN(chunk, sizeof(struct hi_io) * HI_IO_CHUNK);
+      for (i = 0; i < HI_IO_CHUNK; ++i)
+	pthread_mutex_init(&chunk[i].qel.mut, MUTEXATTR);
+      __sync_synchronize();  /* chunk must be complete before others can see it */
+      pool->ios[fd >> HI_IO_CHUNK_SHIFT] = chunk;
+      pool->n_ios += HI_IO_CHUNK;
+      D("new io chunk for fd(%x) n_ios=%d", fd, pool->n_ios);
+    }
+    UNLOCK(pool->ios_mut, "io_slot");
+  }
+  return HI_IO(shf, fd);
+}
+
+/* A shard is a shuffler with its own poll set and todo queue, but which shares
+ * the io table and the PDU pool of its parent. Running one thread per shard
+ * avoids contention on the todo queue and on the poll token. Listeners are
+ * replicated to every shard using SO_REUSEPORT so the kernel spreads
+ * accepts (see hi_open_listener()). */
+
+struct hiios* hi_new_shard(struct hiios* pool)
+{
+  struct hiios* shf;
+  ZMALLOC(shf);
+  shf->pool = pool;
+  ++pool->n_shards;
+  hi_init_poll(shf, pool->max_ios);
   return shf;
 }
 
@@ -132,6 +398,7 @@ void setkernelbufsizes(int fd, int tx, int rx)
 
 extern int nkbuf;
 extern int listen_backlog;
+extern int timeout;
 
 struct hi_io* hi_open_listener(struct hiios* shf, struct hi_host_spec* hs, int proto)
 {
@@ -150,6 +417,14 @@ struct hi_io* hi_open_listener(struct hiios* shf, struct hi_host_spec* hs, int p
     ERR("Failed to call setsockopt(REUSEADDR) on %d: %d %s", fd, errno, STRERROR(errno));
     exit(2);
   }
+#ifdef SO_REUSEPORT
+  if (shf->pool->n_shards > 1) {  /* Every shard binds its own listener to same port */
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char*)&tmp, sizeof(tmp)) == -1) {
+      ERR("Failed to call setsockopt(REUSEPORT) on %d: %d %s", fd, errno, STRERROR(errno));
+      exit(2);
+    }
+  }
+#endif
 
   if (bind(fd, (struct sockaddr*)&hs->sin, sizeof(struct sockaddr_in))) {
     ERR("Unable to bind socket %d (%s): %d %s (trying again in 2 secs)",
@@ -172,9 +447,15 @@ struct hi_io* hi_open_listener(struct hiios* shf, struct hi_host_spec* hs, int p
     return 0;
   }
 
-  io = shf->ios + fd;
+  if (!(io = hi_io_slot(shf, fd))) {
+    close(fd);
+    return 0;
+  }
 
 #ifdef LINUX
+#ifdef HAVE_IO_URING
+  if (!shf->ur)  /* else poll is added once io is set up, below */
+#endif
   {
     struct epoll_event ev;
     ev.events = EPOLLIN | EPOLLET;  /* ET == EdgeTriggered */
@@ -200,17 +481,63 @@ struct hi_io* hi_open_listener(struct hiios* shf, struct hi_host_spec* hs, int p
 #endif
 
   io->fd = fd;
+  io->shf = shf;
   io->qel.kind = HI_LISTEN;
   io->qel.proto = proto;
   io->description = hs->specstr;
+#ifdef HAVE_IO_URING
+  ++io->ur_gen;
+  if (shf->ur)
+    hi_ur_poll_add(shf, fd, &io->qel, EPOLLIN);
+#endif
   D("listen(%x) hs(%s)", fd, hs->specstr);
   return io;
 }
 
+/* Set up io for fd, including its protocol state, and only then add it to the
+ * poll set: with several threads its first edge may be processed before we
+ * return, and under EPOLLET that edge does not come again. */
+
 struct hi_io* hi_add_fd(struct hiios* shf, int fd, int proto, int kind, char *desc)
 {
-  struct hi_io* io = shf->ios + fd;  /* uniqueness of fd acts as mutual exclusion mechanism */
+  struct hi_io* io = hi_io_slot(shf, fd);  /* uniqueness of fd acts as mutual exclusion mechanism */
+  if (!io) {
+    close(fd);
+    return 0;
+  }
 
+  io->fd = fd;
+  io->shf = shf;
+  io->qel.kind = kind;
+  io->qel.proto = proto;
+  io->qel.flags = 0;  /* e.g. HI_F_NOSOCK of previous user of the slot */
+  ASSERT(!io->to_write_in && !io->to_write_consume && !io->in_write);  /* see hi_pin() */
+  io->closing = io->corked = 0;
+  memset(&io->ad, 0, sizeof(io->ad));  /* e.g. SIS binding of previous user of the slot */
+  io->description = desc;
+  io->timer.io = io;
+  io->last_io = time(0);
+  switch (proto) {
+  case S5066_SMTP:
+    if (kind == HI_TCP_S)
+      io->ad.smtp.state = SMTP_START;  /* server speaks first, see hi_accept1() */
+    break;
+  case S5066_DTS:
+    io->ad.dts = dts_new_conn();  /* remote station is learned from its D_PDUs */
+    dts_link_add(io);
+    break;
+  }
+  if (timeout && kind != HI_LISTEN)
+    hi_wake_at(io, (io->last_io + timeout + 1) * 1000000LL);
+
+#ifdef HAVE_IO_URING
+  io->ur_write = io->ur_close = 0;
+  ++io->ur_gen;
+  if (shf->ur) {
+    hi_ur_poll_add(shf, fd, &io->qel, EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP);
+    return io;
+  }
+#endif
 #ifdef LINUX
   {
     struct epoll_event ev;
@@ -218,8 +545,7 @@ struct hi_io* hi_add_fd(struct hiios* shf, int fd, int proto, int kind, char *de
     ev.data.ptr = io;
     if (epoll_ctl(shf->ep, EPOLL_CTL_ADD, fd, &ev)) {
       ERR("Unable to epoll_ctl(%d): %d %s", fd, errno, STRERROR(errno));
-      close(fd);
-      return 0;
+      goto fail;
     }
   }
 #endif
@@ -230,17 +556,18 @@ struct hi_io* hi_add_fd(struct hiios* shf, int fd, int proto, int kind, char *de
     pfd.events = POLLIN | POLLOUT | POLLERR | POLLHUP;
     if (write(shf->ep, &pfd, sizeof(pfd)) == -1) {
       ERR("Unable to write to /dev/poll fd(%d): %d %s", fd, errno, STRERROR(errno));
-      close(fd);
-      return 0;
+      goto fail;
     }
   }
 #endif
-
-  io->fd = fd;
-  io->qel.kind = kind;
-  io->qel.proto = proto;
-  io->description = desc;
   return io;
+
+ fail:
+  hi_timer_cancel(shf, &io->timer);
+  dts_close_conn(0, io);  /* nothing was queued to it yet, so no PDUs to free */
+  io->fd |= 0x80000000;
+  close(fd);
+  return 0;
 }
 
 struct hi_io* hi_open_tcp(struct hiios* shf, struct hi_host_spec* hs, int proto)
@@ -267,192 +594,670 @@ struct hi_io* hi_open_tcp(struct hiios* shf, struct hi_host_spec* hs, int proto)
   return hi_add_fd(shf, fd, proto, HI_TCP_C, hs->specstr);
 }
 
-static void hi_accept(struct hi_thr* hit, struct hi_io* listener)
+/* Accept one connection. Returns 1 if the backlog may have more. On Linux accept4(2)
+ * makes the fd nonblocking and SO_SNDBUF and SO_RCVBUF are inherited from the
+ * listener, see hi_open_listener(), so no fcntl(2) or setsockopt(2) is needed. */
+
+static int hi_accept1(struct hi_thr* hit, struct hi_io* listener)
 {
-  struct hi_host_spec* hs;
   struct hi_io* io;
   struct sockaddr_in sa;
-  int fd, size;
+  socklen_t size;
+  int fd;
   size = sizeof(sa);
-  if ((fd = accept(listener->fd, (struct sockaddr*)&sa, &size)) == -1) {
-    if (errno != EAGAIN)
+#if defined(LINUX) && defined(SOCK_NONBLOCK)
+  fd = accept4(listener->fd, (struct sockaddr*)&sa, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  fd = accept(listener->fd, (struct sockaddr*)&sa, &size);
+#endif
+  if (fd == -1) {
+    switch (errno) {
+    case EINTR:
+    case ECONNABORTED: return 1;  /* peer gave up while in backlog, try next */
+    case EAGAIN:       return 0;  /* backlog exhausted (c.f. edge triggered epoll) */
+    default:
       ERR("Unable to accept from %d: %d %s", listener->fd, errno, STRERROR(errno));
-    return;
+      return 0;
+    }
   }
+#if !defined(LINUX) || !defined(SOCK_NONBLOCK)
   nonblock(fd);
   if (nkbuf)
     setkernelbufsizes(fd, nkbuf, nkbuf);
+#endif
   io = hi_add_fd(hit->shf, fd, listener->qel.proto, HI_TCP_S, listener->description);
+  if (!io) {
+    /* Over -nfd, hi_add_fd() closed it. Keep draining: the listener is edge
+     * triggered, so connections left in the backlog would hang until some
+     * new one arrives. */
+    ERR("Refused connection from listener(%x): too many fds", listener->fd);
+    ++listener->n_refused;
+    return 1;
+  }
   D("accept(%x) from(%x)", fd, listener->fd);
-  ++listener->n_read;  /* n_read counter is used for accounting accepts */
+  ++listener->n_accepted;
   
-  switch (listener->qel.proto) {
-  case S5066_SMTP: /* In SMTP, server starts speaking first */
+  if (listener->qel.proto == S5066_SMTP)  /* In SMTP, server starts speaking first */
     hi_sendf(hit, io, "220 %s smtp ready\r\n", SMTP_GREET_DOMAIN);
-    io->ad.smtp.state = SMTP_START;
-    break;
-  case S5066_DTS:
-    ZMALLOC(io->ad.dts);
-    io->ad.dts->remote_station_addr[0] = 0x61;   /* three nibbles long (padded with zeroes) */
-    io->ad.dts->remote_station_addr[1] = 0x45;
-    io->ad.dts->remote_station_addr[2] = 0x00;
-    io->ad.dts->remote_station_addr[3] = 0x00;
-    if (!(hs = prototab[S5066_DTS].specs)) {
-      ZMALLOC(hs);
-      hs->proto = S5066_DTS;
-      hs->specstr = "dts:accepted:connections";
-      hs->next = prototab[S5066_DTS].specs;
-      prototab[S5066_DTS].specs = hs;
-    }
-    io->n = hs->conns;
-    hs->conns = io;
-    break;
-  }
-  
-  hi_todo_produce(hit->shf, &listener->qel);  /* Must exhaust accept. Either loop here or reenqueue. */
+  return 1;
+}
+
+/* Must exhaust accept. Up to HI_ACCEPT_BUDGET connections are taken per todo item,
+ * then listener goes to the back of the todo queue, so that a reconnect storm of
+ * hundreds of SIS clients does not hold off traffic on connections already up. */
+
+static void hi_accept(struct hi_thr* hit, struct hi_io* listener)
+{
+  int n;
+  ++listener->n_accept_runs;
+  for (n = 0; n < HI_ACCEPT_BUDGET; ++n)
+    if (!hi_accept1(hit, listener))
+      return;
+  hi_todo_produce(hit->shf, &listener->qel);
 }
 
 void sis_clean(struct hi_io* io);
 
+/* Take reading or writing ownership of io, see hi_read() and hi_write(), unless
+ * this thread already has it. The owner never blocks as the fds are nonblocking,
+ * so it lets go soon. Returns 1 if ownership was taken. */
+
+static int hi_own(struct hi_thr* hit, struct hi_thr** owner)
+{
+  if (*owner == hit)
+    return 0;
+  while (!__sync_bool_compare_and_swap(owner, 0, hit))
+    sched_yield();
+  return 1;
+}
+
+/* Close connection and free what it holds. With several threads the reader,
+ * the writer, and e.g. an idle timeout may all find the connection gone at once:
+ * the first one closes, once the others are out of hi_read() and hi_write(). */
+
 void hi_close(struct hi_thr* hit, struct hi_io* io)
 {
   struct hi_pdu* pdu;
-  int fd = io->fd;
+  struct hi_pdu* nxt;
+  struct hi_pdu* dead = 0;
+  struct hi_pdu** prev;
+  int fd = io->fd, took_r, took_w;
   D("close(%x)", fd);
-#if 0  /* should never happen because io had to be consumed before hi_in_out() was called. */
-  LOCK(hit->shf->todo_mut, "hi_close");
-  if (io->qel.inqueue) {
-    if (hit->shf->todo_consume == &io->qel) {
-      hi_todo_consume_inlock(hit->shf);
-    } else {  /* Tricky consume from middle of queue. O(n) to queue size :-( */
-      /* Since io->inqueue is set, io must be in the queue. If it's not, following loop
-       * will crash with NULL next pointer in the end. Or be infinite loop if a
-       * loop of next pointers was somehow created. Both are programming errors. */
-      for (qe = hit->shf->todo_consume; 1; qe = qe->n)
-	if (qe->n == &io->qel) {
-	  qe->n = io->qel.n;
-	  break; /* only way out */
-	}
-      if (!qe->n)
-	hit->shf->todo_produce = qe;
-      qe->n = 0;
-      qe->inqueue = 0;
-      --hit->shf->n_todo;
-    }
+  if (fd & 0x80000000)
+    return;  /* already closed */
+  if (!__sync_bool_compare_and_swap(&io->closing, 0, 1))
+    return;  /* other thread is closing it */
+  took_r = hi_own(hit, &io->reading);
+  took_w = hi_own(hit, &io->writing);
+#ifdef HAVE_IO_URING
+  if (io->ur_write == 1) {  /* kernel still uses in_write: finish once writev completes */
+    io->ur_close = 1;
+    shutdown(fd, SHUT_RDWR);
+    io->closing = 0;
+    if (took_w)
+      __sync_lock_release(&io->writing);
+    if (took_r)
+      __sync_lock_release(&io->reading);
+    return;
   }
-  UNLOCK(hit->shf->todo_mut, "hi_close");
-#else
-  ASSERT(!io->qel.inqueue);
 #endif
+
+  /* io may still be in todo, e.g. a DTS link that hi_flush() wrote to, and
+   * failed, while hi_poll() had queued it. hi_in_out() skips it once closed. */
+  while (io->n_pins > (hit->pin == io ? hit->n_pin : 0))
+    sched_yield();  /* let senders finish their push, see hi_pin() */
+  
   /* *** deal with freeing associated PDUs. If fail, consider shutdown() of socket
    *     and reenqueue to todo list so freeing can be tried again later. */
   
-  for (pdu = io->reqs; pdu; pdu = pdu->n)
+  /* Requests still referenced, e.g. being sent elsewhere, stay in reqs: the last
+   * hi_pdu_release() unlinks and frees them, even if the slot was reused by then. */
+  
+  LOCK(io->qel.mut, "close reqs");
+  for (prev = &io->reqs; (pdu = *prev); )
+    if (pdu->refs)
+      prev = &pdu->n;
+    else {
+      *prev = pdu->n;
+      pdu->n = dead;
+      dead = pdu;
+    }
+  UNLOCK(io->qel.mut, "close reqs");
+  for (pdu = dead; pdu; pdu = nxt) {
+    nxt = pdu->n;
     hi_free_req(hit, pdu);
+  }
   
-  if (io->cur_pdu)
+  if (io->cur_pdu) {
     hi_free_req(hit, io->cur_pdu);
+    io->cur_pdu = 0;
+  }
+  hi_drop_writes(hit, io);
   
+  hi_timer_cancel(io->shf, &io->timer);
   sis_clean(io);
+  dts_close_conn(hit, io);
   
   io->fd |= 0x80000000;  /* mark as free */
+  if (took_w)
+    __sync_lock_release(&io->writing);
+  if (took_r)
+    __sync_lock_release(&io->reading);
+#ifdef HAVE_IO_URING
+  if (io->shf->ur)
+    hi_ur_poll_del(io->shf, io);
+#endif
   close(fd);             /* now some other thread may reuse the slot by accept()ing same fd */
   D("closed(%x)", fd);
 }
 
 /* -------- todo_queue management -------- */
 
-static struct hi_qel* hi_todo_consume_inlock(struct hiios* shf)
+/* Splice chain first..last (already linked through qel.n) to the produce end. */
+
+static void hi_todo_push(struct hiios* shf, struct hi_qel* first, struct hi_qel* last)
+{
+  struct hi_qel* prev;
+  last->n = 0;
+  prev = __sync_lock_test_and_set(&shf->todo_produce, last);  /* full barrier on x86 */
+  prev->n = first;  /* until this store the consumer sees a broken chain and backs off */
+}
+
+/* Consumer side. Caller must hold todo_mut. Returns 0 if the queue is empty, or
+ * if a producer is halfway through hi_todo_push() (it will bump todo_seq once done). */
+
+static struct hi_qel* hi_todo_pop(struct hiios* shf)
 {
   struct hi_qel* qe = shf->todo_consume;
-  shf->todo_consume = qe->n;
-  if (!qe->n)
-    shf->todo_produce = 0;
+  struct hi_qel* n = qe->n;
+  if (qe == &shf->todo_stub) {
+    if (!n)
+      return 0;
+    shf->todo_consume = qe = n;
+    n = n->n;
+  }
+  if (!n) {
+    if (qe != shf->todo_produce)
+      return 0;
+    hi_todo_push(shf, &shf->todo_stub, &shf->todo_stub);  /* qe is last: put stub behind it so it can be unlinked */
+    n = qe->n;
+    if (!n)
+      return 0;
+  }
+  shf->todo_consume = n;
   qe->n = 0;
-  qe->inqueue = 0;
-  --shf->n_todo;
+  __sync_fetch_and_sub(&shf->n_todo, 1);
+  __sync_lock_release(&qe->inqueue);  /* from now on qe may be produced again */
   return qe;
 }
 
-static struct hi_qel* hi_todo_consume(struct hiios* shf)
+/* Idle threads sleep on todo_seq. They go to sleep only if todo_seq still has the
+ * value it had before they found the queue empty, thus a produce that raced with
+ * the emptiness check is never lost. */
+
+static void hi_park(struct hiios* shf, int seq)
 {
-  struct hi_qel* qe;
-  LOCK(shf->todo_mut, "todo_con");
-  while (!shf->todo_consume && !shf->poll_tok.proto)
+#ifdef LINUX
+  if (syscall(SYS_futex, &shf->todo_seq, FUTEX_WAIT_PRIVATE, seq, 0, 0, 0) == -1
+      && errno != EAGAIN && errno != EINTR)
+    ERR("futex wait: %d %s", errno, STRERROR(errno));
+#else
+  LOCK(shf->todo_mut, "park");
+  if (shf->todo_seq == seq)
     pthread_cond_wait(&shf->todo_cond, &shf->todo_mut);
-  if (shf->todo_consume)
-    qe = hi_todo_consume_inlock(shf);
-  else {
-    ASSERT(shf->poll_tok.proto);
-    shf->poll_tok.proto = 0;
-    qe = &shf->poll_tok;
-  }
-  UNLOCK(shf->todo_mut, "todo_con");
-  return qe;
+  UNLOCK(shf->todo_mut, "park");
+#endif
 }
 
-void hi_todo_produce(struct hiios* shf, struct hi_qel* qe)
+static void hi_unpark(struct hiios* shf, int n)
 {
-  LOCK(shf->todo_mut, "todo_prod");
-  if (!qe->inqueue) {
-    if (shf->todo_produce)
-      shf->todo_produce->n = qe;
-    else
-      shf->todo_consume = qe;
-    shf->todo_produce = qe;
-    qe->n = 0;
-    qe->inqueue = 1;
-    ++shf->n_todo;
+#ifdef LINUX
+  if (syscall(SYS_futex, &shf->todo_seq, FUTEX_WAKE_PRIVATE, n, 0, 0, 0) == -1)
+    ERR("futex wake: %d %s", errno, STRERROR(errno));
+#else
+  LOCK(shf->todo_mut, "unpark");
+  if (n == 1)
     pthread_cond_signal(&shf->todo_cond);
+  else
+    pthread_cond_broadcast(&shf->todo_cond);
+  UNLOCK(shf->todo_mut, "unpark");
+#endif
+}
+
+static int hi_todo_empty(struct hiios* shf)
+{
+  return shf->todo_consume == &shf->todo_stub && shf->todo_produce == &shf->todo_stub;
+}
+
+struct hi_qel* hi_todo_consume(struct hiios* shf)
+{
+  struct hi_qel* qe;
+  int seq;
+  while (1) {
+    seq = __sync_fetch_and_add(&shf->todo_seq, 0);
+    LOCK(shf->todo_mut, "todo_con");
+    qe = hi_todo_pop(shf);
+    UNLOCK(shf->todo_mut, "todo_con");
+    if (qe)
+      return qe;
+    if (__sync_bool_compare_and_swap(&shf->poll_tok.proto, 1, 0)) {
+      __sync_lock_test_and_set(&shf->polling, 1);  /* barrier: hi_poll() rechecks queue */
+      return &shf->poll_tok;
+    }
+    __sync_fetch_and_add(&shf->n_idle, 1);
+    hi_park(shf, seq);
+    __sync_fetch_and_sub(&shf->n_idle, 1);
   }
-  UNLOCK(shf->todo_mut, "todo_prod");
 }
 
+/* Typically called by a thread of another shard that produced work for us, e.g.
+ * SIS client on one shard sending to DTS link on other shard. */
+
+static void hi_wake(struct hiios* shf)
+{
+#ifdef LINUX
+  uint64_t one = 1;
+#else
+  char one = 1;
+#endif
+  if (write(shf->wake_fd[1], &one, sizeof(one)) == -1 && errno != EAGAIN)
+    ERR("write(wake_fd=%x): %d %s", shf->wake_fd[1], errno, STRERROR(errno));
+}
+
+static void hi_drain_wake(struct hiios* shf)
+{
+  char buf[64];
+  while (read(shf->wake_fd[0], buf, sizeof(buf)) > 0) ;
+}
+
+void hi_todo_produce(struct hiios* shf, struct hi_qel* qe)
+{
+  if (!__sync_bool_compare_and_swap(&qe->inqueue, 0, 1))
+    return;  /* already in queue */
+  __sync_fetch_and_add(&shf->n_todo, 1);
+  hi_todo_push(shf, qe, qe);
+  __sync_fetch_and_add(&shf->todo_seq, 1);
+  if (shf->n_idle)
+    hi_unpark(shf, 1);
+  else if (shf->polling)
+    hi_wake(shf);  /* Only thread that could take this is in epoll_wait(), kick it */
+}
+
+/* Timer wheel. Arming and cancelling a timer is O(1): the timer is linked to
+ * the slot of its level, see struct hi_timer, and a bit in tw_map says the slot is
+ * nonempty. The polling thread bounds its wait by the next slot that needs
+ * attention and, once awake, turns the wheel up to the current time, see
+ * hi_tw_advance(). Ticks where nothing happens are skipped. When a timer fires,
+ * its io is put to todo, and e.g. hi_in_out() finds out what is due. PDUs
+ * that need a time out, e.g. ARQ D_PDUs, are looked after by their io.
+ * Timers are per shuffler, protect by timer_mut. */
+
+long long hi_now_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+long long hi_now_ms()
+{
+  return hi_now_us() / 1000;
+}
+
+static void hi_tw_link(struct hiios* shf, struct hi_timer* t, int l, int i)
+{
+  struct hi_timer** head = &shf->tw[l][i];
+  if ((t->n = *head))
+    t->n->pp = &t->n;
+  t->pp = head;
+  *head = t;
+  t->slot = l * HI_TW_SLOTS + i;
+  shf->tw_map[l] |= 1ULL << i;
+}
+
+static void hi_tw_unlink(struct hiios* shf, struct hi_timer* t)
+{
+  int l = t->slot / HI_TW_SLOTS, i = t->slot % HI_TW_SLOTS;
+  if ((*t->pp = t->n))
+    t->n->pp = t->pp;
+  t->pp = 0;
+  if (!shf->tw[l][i])
+    shf->tw_map[l] &= ~(1ULL << i);
+}
+
+/* Place timer on the lowest level whose span covers it. Timers due by tw_tick
+ * fire now if batch b is supplied, else on the next tick. */
+
+struct hi_todo_batch;
+static void hi_batch_add(struct hi_todo_batch* b, struct hi_qel* qe);
+
+static void hi_tw_place(struct hiios* shf, struct hi_timer* t, struct hi_todo_batch* b)
+{
+  long long e = t->expire, d;
+  int l;
+  if (e <= shf->tw_tick) {
+    if (b) {
+      t->pp = 0;
+      hi_batch_add(b, &t->io->qel);
+      return;
+    }
+    e = shf->tw_tick + 1;
+  }
+  d = e - shf->tw_tick;
+  for (l = 0; l < HI_TW_LEVELS - 1 && d >> (HI_TW_BITS * (l + 1)); ++l) ;
+  if (d >> (HI_TW_BITS * HI_TW_LEVELS))
+    e = shf->tw_tick + (1LL << (HI_TW_BITS * HI_TW_LEVELS)) - 1;  /* beyond the wheel */
+  hi_tw_link(shf, t, l, (e >> (HI_TW_BITS * l)) & (HI_TW_SLOTS - 1));
+}
+
+/* Time, in ms, of the next tick that fires timers, or moves them to a lower
+ * level. -1 if the wheel is empty. */
+
+static long long hi_tw_next(struct hiios* shf)
+{
+  unsigned long long map;
+  long long t, next = -1;
+  int l, r;
+  for (l = 0; l < HI_TW_LEVELS; ++l) {
+    if (!(map = shf->tw_map[l]))
+      continue;
+    r = ((shf->tw_tick >> (HI_TW_BITS * l)) + 1) & (HI_TW_SLOTS - 1);  /* slot after current */
+    if (r)
+      map = map >> r | map << (HI_TW_SLOTS - r);
+    t = ((shf->tw_tick >> (HI_TW_BITS * l)) + 1 + __builtin_ctzll(map)) << (HI_TW_BITS * l);
+    if (next == -1 || t < next)
+      next = t;
+  }
+  return next;
+}
+
+/* Advance tw_tick by one: move the timers of higher level slots that come due
+ * down the wheel, and fire those in the level 0 slot. */
+
+static void hi_tw_tick(struct hiios* shf, struct hi_todo_batch* b)
+{
+  struct hi_timer* t;
+  struct hi_timer* nxt;
+  long long tick = ++shf->tw_tick;
+  int l, i;
+  for (l = 1; l < HI_TW_LEVELS && !(tick & ((1LL << (HI_TW_BITS * l)) - 1)); ++l) {
+    i = (tick >> (HI_TW_BITS * l)) & (HI_TW_SLOTS - 1);
+    t = shf->tw[l][i];
+    shf->tw[l][i] = 0;
+    shf->tw_map[l] &= ~(1ULL << i);
+    for (; t; t = nxt) {
+      nxt = t->n;
+      hi_tw_place(shf, t, b);
+    }
+  }
+  i = tick & (HI_TW_SLOTS - 1);
+  t = shf->tw[0][i];
+  shf->tw[0][i] = 0;
+  shf->tw_map[0] &= ~(1ULL << i);
+  for (; t; t = nxt) {
+    nxt = t->n;
+    t->pp = 0;
+    hi_batch_add(b, &t->io->qel);
+  }
+}
+
+static void hi_tw_advance(struct hiios* shf, long long now, struct hi_todo_batch* b)
+{
+  long long next;
+  while (shf->tw_tick < now) {
+    next = hi_tw_next(shf);
+    if (next == -1 || next > now) {
+      shf->tw_tick = now;  /* nothing happens in between */
+      return;
+    }
+    shf->tw_tick = next - 1;
+    hi_tw_tick(shf, b);
+  }
+}
+
+static void hi_timer_arm0(struct hiios* shf, struct hi_timer* t, long long ms, int earlier)
+{
+  int wake;
+  LOCK(shf->timer_mut, "timer arm");
+  if (t->pp) {
+    if (earlier && t->expire <= ms) {
+      UNLOCK(shf->timer_mut, "timer arm");
+      return;
+    }
+    hi_tw_unlink(shf, t);
+  }
+  if (!(shf->tw_map[0] | shf->tw_map[1] | shf->tw_map[2] | shf->tw_map[3]))
+    shf->tw_tick = MAX(shf->tw_tick, hi_now_ms());  /* idle wheel: place from now */
+  t->expire = ms;
+  hi_tw_place(shf, t, 0);
+  wake = ms < shf->poll_until;
+  UNLOCK(shf->timer_mut, "timer arm");
+  if (wake && shf->polling)
+    hi_wake(shf);  /* poll timeout was computed for a later time */
+}
+
+/* Arm timer t to fire at ms (see hi_now_ms()), or rearm it if it was armed. */
+
+void hi_timer_arm(struct hiios* shf, struct hi_timer* t, long long ms)
+{
+  hi_timer_arm0(shf, t, ms, 0);
+}
+
+void hi_timer_cancel(struct hiios* shf, struct hi_timer* t)
+{
+  LOCK(shf->timer_mut, "timer cancel");
+  if (t->pp)
+    hi_tw_unlink(shf, t);
+  UNLOCK(shf->timer_mut, "timer cancel");
+}
+
+/* Ask for hi_in_out() on io at usec (see hi_now_us()), e.g. when a paced DTS link
+ * may release its next D_PDU. If io already waits for an earlier time, that stands. */
+
+void hi_wake_at(struct hi_io* io, long long usec)
+{
+  long long ms = (usec + 999) / 1000;
+  if (io->timer.pp && io->timer.expire <= ms)
+    return;  /* unlocked peek: should the timer fire meanwhile, hi_in_out() runs and can ask again */
+  hi_timer_arm0(io->shf, &io->timer, ms, 1);
+}
+
+/* Milliseconds until the wheel needs turning, or -1 if it is empty. */
+
+static int hi_timer_timeout(struct hiios* shf)
+{
+  long long ms = -1, next;
+  LOCK(shf->timer_mut, "timer to");
+  next = hi_tw_next(shf);
+  shf->poll_until = next == -1 ? 0x7fffffffffffffffLL : next;
+  if (next != -1)
+    ms = MAX(MIN(next - hi_now_ms(), 3600000), 0);
+  UNLOCK(shf->timer_mut, "timer to");
+  return ms;
+}
+
+/* Batched produce for hi_poll(): collect the ready ios in a local chain and splice
+ * it to the queue with a single atomic exchange, then wake as many parked threads
+ * as there is new work (the polling thread itself takes one, too). */
+
+struct hi_todo_batch {
+  struct hi_qel* first;
+  struct hi_qel* last;
+  int n;
+};
+
+static void hi_batch_add(struct hi_todo_batch* b, struct hi_qel* qe)
+{
+  if (!__sync_bool_compare_and_swap(&qe->inqueue, 0, 1))
+    return;  /* already in queue */
+  if (b->last)
+    b->last->n = qe;
+  else
+    b->first = qe;
+  b->last = qe;
+  ++b->n;
+}
+
+static void hi_batch_produce(struct hiios* shf, struct hi_todo_batch* b)
+{
+  int idle;
+  if (!b->n)
+    return;
+  __sync_fetch_and_add(&shf->n_todo, b->n);
+  hi_todo_push(shf, b->first, b->last);
+  __sync_fetch_and_add(&shf->todo_seq, 1);
+  idle = shf->n_idle;
+  if (idle)
+    hi_unpark(shf, MIN(b->n, idle));
+}
+
+/* Fire the timers that are due. The ios are put to todo with their events as
+ * they are: if there is nothing to read or write, hi_in_out() finds out harmlessly. */
+
+static void hi_timer_expire(struct hiios* shf, struct hi_todo_batch* b)
+{
+  long long now = hi_now_ms();
+  LOCK(shf->timer_mut, "timer exp");
+  hi_tw_advance(shf, now, b);
+  shf->poll_until = 0;  /* no longer polling with the timeout */
+  UNLOCK(shf->timer_mut, "timer exp");
+}
+
+#ifdef HAVE_IO_URING
+/* Wait up to timeout ms for completions and turn them into todo items, like
+ * the epoll_wait() loop in hi_poll() does with events. Completed writevs are
+ * picked up by hi_flush() once hi_poll() returns to hi_shuffle(). */
+
+static void hi_ur_reap(struct hi_thr* hit, struct hiios* shf, int timeout, struct hi_todo_batch* b)
+{
+  struct hi_uring* ur = shf->ur;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  struct io_uring_cqe* cqe;
+  struct hi_qel* qe;
+  struct hi_io* io;
+  unsigned head = *ur->cq_head;
+  
+  if (head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE) && timeout) {
+    memset(&arg, 0, sizeof(arg));
+    if (timeout > 0) {
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000LL;
+      arg.ts = (uintptr_t)&ts;
+    }
+    if (syscall(__NR_io_uring_enter, ur->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		&arg, sizeof(arg)) == -1 && errno != EINTR && errno != ETIME)
+      ERR("io_uring_enter(%x): %d %s", ur->fd, errno, STRERROR(errno));
+  }
+  for (shf->n_evs = 0; head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE); ++head) {
+    cqe = &ur->cqes[head & ur->cq_mask];
+    ++shf->n_evs;
+    if (!cqe->user_data)
+      continue;  /* POLL_REMOVE */
+    if (cqe->user_data & HI_UR_WRITE) {
+      io = (struct hi_io*)(uintptr_t)(cqe->user_data & HI_UR_PTR);
+      if ((cqe->user_data & ~(HI_UR_PTR | HI_UR_WRITE)) != HI_UR_GEN(io))
+	continue;  /* for previous user of the slot */
+      io->ur_wres = cqe->res;
+      __sync_synchronize();
+      io->ur_write = 2;
+      hi_flush_add(hit, io);  /* not todo: hi_in_out() would read on stale events */
+      continue;
+    }
+    qe = (struct hi_qel*)(uintptr_t)cqe->user_data;
+    if (qe->kind == HI_WAKE) {
+      hi_drain_wake(shf);
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+	hi_ur_poll_add(shf, shf->wake_fd[0], qe, EPOLLIN);
+      continue;
+    }
+    io = (struct hi_io*)qe;
+    if (io->fd & 0x80000000 || cqe->res == -ECANCELED)
+      continue;
+    if (cqe->res < 0) {
+      ERR("io_uring poll fd(%x): %d %s", io->fd, -cqe->res, STRERROR(-cqe->res));
+      continue;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))  /* multishot ended, e.g. CQ overflow */
+      hi_ur_poll_add(shf, io->fd, qe, EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP);
+    io->events = cqe->res;
+    if (!io->cur_pdu || io->cur_pdu->need)
+      hi_batch_add(b, &io->qel);
+  }
+  __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
 /* ---------- shuffler ---------- */
 
 extern int debugpoll;
 #define DP(format,...) (debugpoll && (fprintf(stderr, "t%x %9s:%-3d %-16s p " format "\n", (int)pthread_self(), __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__), fflush(stderr)))
 
-static void hi_poll(struct hiios* shf)
+static void hi_poll(struct hi_thr* hit, struct hiios* shf)
 {
   struct hi_io* io;
+  struct hi_todo_batch b;
   int i;
+  /* Work produced after we found the queue empty, but before polling was set, did
+   * not kick the wake fd. Do not block if there is any. */
+  int timeout = hi_todo_empty(shf) ? hi_timer_timeout(shf) : 0;
   DP("epoll(%x)", shf->ep);
+  b.first = b.last = 0;
+  b.n = 0;
 #ifdef LINUX
-  shf->n_evs = epoll_wait(shf->ep, shf->evs, shf->max_evs, -1);
-  if (shf->n_evs == -1) {
-    ERR("epoll_wait(%x): %d %s", shf->ep, errno, STRERROR(errno));
-    return;
-  }
-  for (i = 0; i < shf->n_evs; ++i) {
-    io = (struct hi_io*)shf->evs[i].data.ptr;
-    io->events = shf->evs[i].events;
-    if (!io->cur_pdu || io->cur_pdu->need)
-      hi_todo_produce(shf, &io->qel);  /* *** should the todo_mut lock be batched instead? */
+#ifdef HAVE_IO_URING
+  if (shf->ur)
+    hi_ur_reap(hit, shf, timeout, &b);
+  else
+#endif
+  {
+    shf->n_evs = epoll_wait(shf->ep, shf->evs, shf->max_evs, timeout);
+    if (shf->n_evs == -1) {
+      if (errno != EINTR)
+	ERR("epoll_wait(%x): %d %s", shf->ep, errno, STRERROR(errno));
+      shf->n_evs = 0;  /* fall thru so the poll token is released */
+    }
+    for (i = 0; i < shf->n_evs; ++i) {
+      io = (struct hi_io*)shf->evs[i].data.ptr;
+      if (io->qel.kind == HI_WAKE) {
+	hi_drain_wake(shf);
+	continue;
+      }
+      io->events = shf->evs[i].events;
+      if (!io->cur_pdu || io->cur_pdu->need)
+	hi_batch_add(&b, &io->qel);
+    }
   }
 #endif
 #ifdef SUNOS
   {
     struct dvpoll dp;
-    dp.dp_timeout = -1;
+    dp.dp_timeout = timeout;
     dp.dp_nfds = shf->max_evs;
     dp.dp_fds = shf->evs;
     shf->n_evs = ioctl(shf->ep, DP_POLL, &dp);
     if (shf->n_evs < 0) {
-      ERR("/dev/poll ioctl(%x): %d %s", shf->ep, errno, STRERROR(errno));
-      return;
+      if (errno != EINTR)
+	ERR("/dev/poll ioctl(%x): %d %s", shf->ep, errno, STRERROR(errno));
+      shf->n_evs = 0;
     }
     for (i = 0; i < shf->n_evs; ++i) {
-      io = shf->ios + shf->evs[i].fd;
+      if (shf->evs[i].fd == shf->wake_fd[0]) {
+	hi_drain_wake(shf);
+	continue;
+      }
+      io = HI_IO(shf, shf->evs[i].fd);
       io->events = shf->evs[i].revents;
       if (!io->cur_pdu || io->cur_pdu->need)
-	hi_todo_produce(shf, &io->qel);  /* *** should the todo_mut lock be batched instead? */
+	hi_batch_add(&b, &io->qel);
     }
   }
 #endif
-  LOCK(shf->todo_mut, "todo_prod");
-  shf->poll_tok.proto = 1;
-  UNLOCK(shf->todo_mut, "todo_prod");
+  hi_timer_expire(shf, &b);
+  hi_batch_produce(shf, &b);
+  shf->polling = 0;
+  __sync_synchronize();
+  shf->poll_tok.proto = 1;  /* token is available again */
 }
 
 void hi_process(struct hi_thr* hit, struct hi_pdu* pdu)
@@ -470,16 +1275,36 @@ void hi_in_out(struct hi_thr* hit, struct hi_io* io)
 #define EPOLLOUT (POLLOUT)
 #define EPOLLIN  (POLLIN)
 #endif
+  if (io->fd & 0x80000000) {  /* closed while it was in todo queue (handed off by other shard) */
+    D("stale io(%x) events=0x%x", io->fd, io->events);
+    return;
+  }
   if (io->events & (EPOLLHUP | EPOLLERR)) {
     D("HUP or ERR on fd=%x events=0x%x", io->fd, io->events);
     hi_close(hit, io);
     return;
   }
+  if (timeout) {  /* -t: close connections that have been idle too long */
+    if (time(0) - io->last_io > timeout) {  /* at least timeout, time(2) truncates */
+      D("idle timeout fd=%x", io->fd);
+      hi_close(hit, io);
+      return;
+    }
+    if (!io->timer.pp)  /* else it fires sooner, and we get here to rearm */
+      hi_wake_at(io, (io->last_io + timeout + 1) * 1000000LL);
+  }
   
-  if (io->events & EPOLLOUT) {
+  /* Besides EPOLLOUT, write is tried when other shard handed us PDUs, see hi_send0() */
+  if (io->events & EPOLLOUT || io->to_write_consume || io->to_write_in
+#ifdef HAVE_IO_URING
+      || io->ur_write == 2  /* writev completed, see hi_ur_reap() */
+#endif
+      ) {
     DP("OUT fd=%x n_iov=%d n_to_write=%d", io->fd, io->n_iov, io->n_to_write);
     hi_write(hit, io);
   }
+  if (io->qel.proto == S5066_DTS && !(io->fd & 0x80000000))
+    dts_sched_kick(hit, io);  /* link may have drained, let it take more */
   
   if (io->events & EPOLLIN) {
     DP("IN fd=%x", io->fd);
@@ -494,7 +1319,7 @@ void hi_shuffle(struct hi_thr* hit, struct hiios* shf)
   while (1) {
     qe = hi_todo_consume(shf);
     switch (qe->kind) {
-    case HI_POLL:    hi_poll(shf); break;
+    case HI_POLL:    hi_poll(hit, shf); break;
     case HI_LISTEN:  hi_accept(hit, (struct hi_io*)qe); break;
     case HI_TCP_C:
     case HI_TCP_S:   hi_in_out(hit, (struct hi_io*)qe); break;
@@ -504,6 +1329,12 @@ void hi_shuffle(struct hi_thr* hit, struct hiios* shf)
 #endif
     default: NEVER("unknown qel->kind 0x%x", qe->kind);
     }
+    if (hit->n_flush)
+      hi_flush(hit);  /* write what processing the item sent, see hi_send0() */
+#ifdef HAVE_IO_URING
+    if (shf->ur)
+      hi_ur_submit(shf);  /* the writevs of the item in one go */
+#endif
   }
 }
 
@@ -28,12 +28,33 @@
 #ifndef IOV_MAX
 #define IOV_MAX 16
 #endif
-#define HI_N_IOV (IOV_MAX < 32 ? IOV_MAX : 32)   /* Avoid unreasonably huge iov */
-#if 1
+#define HI_N_IOV (IOV_MAX < 64 ? IOV_MAX : 64)   /* Avoid unreasonably huge iov */
 #define HI_PDU_MEM 2200 /* Default PDU memory buffer size, sufficient for reliable data */
-#else
-#define HI_PDU_MEM 4200 /* Default PDU memory buffer size, sufficient for broadcast data */
-#endif
+#define HI_PDU_MEM_MAX 4736  /* Largest buffer: broadcast data plus headers and DTS rx map */
+
+/* PDU buffers are separate from PDU headers and come in size classes, each with
+ * its own pool. See hi_pdu_alloc() and hi_buf_cls_size[] in hiread.c */
+#define HI_N_BUF_CLS 4  /* 64, 256, HI_PDU_MEM, HI_PDU_MEM_MAX */
+
+/* Read buffers are shared: hi_read() fills one HI_PDU_MEM_MAX buffer with as many
+ * PDUs as the kernel has, and hi_checkmore() carves each PDU out of it as a view.
+ * Such buffer starts with a reference count, and mem_cls has HI_BUF_SHARED set. */
+#define HI_BUF_SHARED 0x40
+#define HI_BUF_HDR    8         /* reference count, keeps the data aligned */
+#define HI_READ_MIN   512       /* move partial PDU to fresh buffer if less room than this */
+
+/* PDU allocator is magazine style: each thread caches free PDUs and exchanges
+ * them with the global depot a magazine (HI_PDU_MAG PDUs) at a time. */
+#define HI_PDU_MAG      8                /* PDUs per magazine */
+#define HI_PDU_CACHE_LO 0                /* refill a magazine when thread cache drops to this */
+#define HI_PDU_CACHE_HI (2*HI_PDU_MAG)  /* return a magazine when thread cache grows above this */
+#define HI_PDU_CHUNK    (8*HI_PDU_MAG)  /* pool grows by this many PDUs at a time, up to -npdu */
+
+/* The fd table is a directory of chunks that are allocated as fds are first
+ * seen. Chunks never move so io pointers stay valid. See hi_io_slot(). */
+#define HI_IO_CHUNK_SHIFT 6
+#define HI_IO_CHUNK (1 << HI_IO_CHUNK_SHIFT)
+#define HI_IO(shf, fd) ((shf)->pool->ios[(fd) >> HI_IO_CHUNK_SHIFT] + ((fd) & (HI_IO_CHUNK-1)))
 
 #define HI_POLL    1    /* Trigger epoll */
 #define HI_PDU     2    /* PDU */
@@ -41,6 +62,7 @@
 #define HI_TCP_S   4    /* TCP server socket, i.e. accept(2)'d from listening socket */
 #define HI_TCP_C   5    /* TCP client socket, i.e. formed using connect(2) */
 #define HI_SNMP    6    /* SNMP (UDP) socket */
+#define HI_WAKE    7    /* eventfd(2) (or pipe) used to kick a shard out of epoll_wait() */
 
 struct hi_qel {         /* hiios task que element. This is the first thing on io and pdu objects */
   struct hi_qel* n;     /* Next in todo_queue */
@@ -51,9 +73,32 @@ struct hi_qel {         /* hiios task que element. This is the first thing on io
   char inqueue;
 };
 
+#define HI_F_URGENT 0x01  /* PDU is written ahead of non urgent ones, see hi_send0() */
+#define HI_F_NOSOCK 0x02  /* io is not a socket, e.g. serial port: no sendmsg(2), see hi_write() */
+
+#define HI_FLUSH_MAX 16   /* ios a thread may defer writing to, see hi_flush() */
+#define HI_ACCEPT_BUDGET 64  /* connections accepted per todo item, see hi_accept() */
+
+/* Timer wheel, see hi_timer_arm(). Level l slots hold timers due 64^l to 64^(l+1)
+ * ticks of 1 ms ahead: 64 ms, 4 s, 4.4 min, and 4.7 h. Timers further out wait
+ * in the last level and are placed again as it turns. */
+
+#define HI_TW_BITS   6
+#define HI_TW_SLOTS  (1 << HI_TW_BITS)  /* per level, one bit each in tw_map */
+#define HI_TW_LEVELS 4
+
+struct hi_timer {
+  struct hi_timer* n;        /* next in wheel slot */
+  struct hi_timer** pp;      /* what points to us, 0 if not armed. Protect by timer_mut */
+  long long expire;          /* ms, see hi_now_ms() */
+  struct hi_io* io;          /* io that is put to todo when the timer fires */
+  short slot;                /* level * HI_TW_SLOTS + slot */
+};
+
 struct hi_io {
   struct hi_qel qel;
   struct hi_io* n;           /* next among io objects, esp. backends */
+  struct hiios* shf;         /* shuffler (shard) whose poll set and todo queue own this io */
   struct hi_io* pair;        /* the other half of a proxy connection */
   int fd;
   char *description;         /* Nito: To be able to map fd->devices/ports. Link to hi_host_spec->specstr */
@@ -61,22 +106,47 @@ struct hi_io {
   char n_iov;
   struct iovec* iov_cur;     /* not used by listeners, only useful for sessions and backend ses */
   struct iovec iov[HI_N_IOV];
+  struct hi_thr* reading;    /* thread in hi_read(), it owns cur_pdu */
+  struct hi_thr* writing;    /* thread in hi_write(), it owns in_write, iov, and to_write */
+  char read_again;           /* hi_read() was called meanwhile, the owner goes another round */
+  char write_again;          /* hi_write() was called meanwhile, the owner goes another round */
+  char corked;               /* last send was MSG_MORE, see hi_uncork() */
+  char closing;              /* a thread is in hi_close(), others leave the io alone */
+  int n_pins;                /* senders between hi_pin() and hi_unpin(), atomic */
   struct hi_pdu* in_write;   /* list of pdus that are in process of being written (have iovs) */
-  int n_to_write;            /* length of to_write queue */
+  int n_to_write;            /* length of to_write_in and to_write queues, atomic */
+  struct hi_pdu* to_write_in;       /* senders push here, newest first, lock free, see hi_send0() */
   struct hi_pdu* to_write_consume;  /* list of PDUs that are imminently goint to be written */
-  struct hi_pdu* to_write_produce;  /* add new pdus here (main thr only) */
+  struct hi_pdu* to_write_produce;  /* last PDU of to_write */
+  struct hi_pdu* to_write_urgent;   /* last HI_F_URGENT PDU in to_write, they come first */
   
   /* Statistics counters */
   int n_written;  /* bytes */
   int n_read;     /* bytes */
   int n_pdu_out;
   int n_pdu_in;
+  int n_accepted;      /* listener: connections accepted */
+  int n_refused;       /* listener: connections dropped for lack of fds (-nfd) */
+  int n_accept_runs;   /* listener: todo items that accepted, n_accepted/n_accept_runs is batch size */
   
   struct hi_pdu* cur_pdu;    /* PDU for which we currently expect to do I/O */
+  struct hi_io* pdu_wait_n;  /* next among ios waiting for PDUs to be freed (pool->pdu_waiters) */
+  char pdu_wait;             /* io is on pdu_waiters list, protect by pool->pdu_mut */
+  struct hi_timer timer;     /* see hi_wake_at() */
+  time_t last_io;            /* last time data was read or written, for -t */
+#ifdef HAVE_IO_URING
+  char ur_write;             /* -uring: 1 = writev in flight, 2 = completed, see hi_write() */
+  char ur_close;             /* hi_close() was called while writev was in flight */
+  short ur_gen;              /* tells completions for previous user of the slot apart */
+  int ur_wres;               /* result of completed writev */
+#endif
   struct hi_pdu* reqs;       /* linked list of real requests of this session, protect by qel.mut */
   union {
     struct dts_conn* dts;
-    int sap;                 /* S5066 SAP ID, indexes into saptab[] and svc_type_tab[] */
+    struct {
+      int sap;               /* S5066 SAP ID, indexes into saptab[] and svc_type_tab[] */
+      struct sis_client* cl; /* our entry in saptab[sap], 0 if not bound */
+    } sis;
     struct {
       struct hi_pdu* uni_ind_hmtp;
       int state;
@@ -96,26 +166,40 @@ struct hi_pdu {
   struct hi_pdu* subresps;   /* subreq: list of resps, to ds_wait() upon */
   struct hi_pdu* reals;      /* linked list of real resps to this req */
   struct hi_pdu* synths;     /* linked list of subreqs and synth resps */
+  int refs;                  /* write queue, dependent resps, and holds, see hi_pdu_release() */
 
   char events;               /* events needed by this PDU (EPOLLIN or EPOLLOUT) */
   char n_iov;
   struct iovec iov[3];       /* Enough for header, payload, and CRC */
   
-  int need;                  /* how much more is needed to complete a PDU? */
+  int need;                  /* how much (counting from m) is needed to complete a PDU? */
   char* scan;                /* How far has protocol parsin progressed, e.g. in SMTP. */
   char* ap;                  /* allocation pointer: next free memory location */
   char* m;                   /* beginning of memory (often m == mem, but could be malloc'd) */
   char* lim;                 /* one past end of memory */
-  char mem[HI_PDU_MEM];      /* memory for processing a PDU */
+  char* mem;                 /* buffer from size class pool mem_cls, or 0 if PDU has none */
+  char mem_cls;              /* size class, possibly | HI_BUF_SHARED */
 
   union {
     struct {
       int n_tx_seq;          /* Transmit Frame Sequence Number */
       int addr_len;
+      int c_pdu_rest;        /* NONARQ: bytes of the C_PDU sent after this D_PDU, incl. repeats */
       char* c_pdu;           /* S5066 DTS segmented C_PDU */
     } dts;
     struct {
-      char rx_map[SIS_MAX_PDU_SIZE/8];  /* bitmap of bytes rx'd so we know if we have rx'd all */
+      struct hi_pdu* segs;   /* NONARQ: D_PDUs of first round, chained by synths, for repeats */
+      struct hi_pdu* segs_last;
+      struct hi_pdu* seg;    /* NONARQ: next D_PDU to repeat */
+      int seg_ix;            /* NONARQ: index of seg */
+      int c_pdu_id;          /* NONARQ */
+      char arq;
+      char ch;               /* DTS_CH_NORMAL or DTS_CH_EXPEDITED */
+      char n_tx;             /* NONARQ: rounds still to send, including current */
+    } dtsq;                  /* C_PDU queued for transmission, see dts_sched_send() */
+    struct {
+      unsigned long long* rx_map; /* bitmap of bytes rx'd, one bit per byte (in mem) */
+      int missing;           /* bytes not yet rx'd, C_PDU is complete when this hits 0 */
     } dtsrx;
     struct {
       char* skip_ehlo;
@@ -127,24 +211,46 @@ struct hi_pdu {
 
 struct c_pdu_buf;
 
+/* Overlay of a free PDU buffer in depot or thread cache. */
+struct hi_buf {
+  struct hi_buf* n;    /* next buffer in same magazine or cache */
+  struct hi_buf* mag;  /* next magazine in depot */
+  int len;             /* number of buffers in magazine */
+};
+
 struct hiios {
+  struct hiios* pool;  /* shuffler that owns ios[] and the PDU pool; self unless this is a shard */
+  int n_shards;        /* (pool only) number of shufflers sharing ios[] and the PDU pool */
   int ep;       /* epoll(4) (Linux 2.6) or /dev/poll (Solaris 8, man -s 7d poll) file descriptor */
   int n_evs;    /* how many useful events last epoll_wait() returned */
   int max_evs;
 #ifdef LINUX
   struct epoll_event* evs;
 #endif
+#ifdef HAVE_IO_URING
+  struct hi_uring* ur;  /* io_uring(7) used instead of epoll (-uring), see hiios.c */
+#endif
 #ifdef SUNOS
   struct pollfd* evs;
 #endif
-  int n_ios;
-  int max_ios;
-  struct hi_io* ios;
+  pthread_mutex_t ios_mut;   /* (pool only) serializes growth of ios directory */
+  int n_ios;                 /* io slots allocated so far */
+  int max_ios;               /* ceiling, fds at or above this are refused (-nfd) */
+  struct hi_io** ios;        /* Directory of HI_IO_CHUNK sized chunks, see HI_IO() */
 
   pthread_mutex_t pdu_mut;
-  int max_pdus;
-  struct hi_pdu* pdus;  /* Global pool of PDUs */
-  struct hi_pdu* free_pdus;
+  int n_pdus;                /* PDUs allocated so far */
+  int max_pdus;              /* ceiling for reading new PDUs from network (-npdu) */
+  struct hi_pdu* free_pdus;  /* Depot: magazines chained by n, PDUs in a magazine by qel.n */
+  int n_free_pdus;
+  struct hi_io* pdu_waiters; /* ios that hit max_pdus, rescheduled when PDUs are freed */
+  /* PDU allocator statistics, see hi_pdu_alloc() */
+  int pdu_hits;         /* allocations served from thread caches (folded in at refill) */
+  int pdu_misses;       /* thread cache empty, went to depot */
+  int pdu_flushes;      /* magazines returned to depot */
+  int pdu_depot_empty;  /* misses that found the depot empty, i.e. out of PDUs */
+  struct hi_buf* free_bufs[HI_N_BUF_CLS];  /* Depot of PDU buffers, magazines per class */
+  int n_bufs[HI_N_BUF_CLS];                /* buffers malloc'd so far, per class */
 
 #if 0
   pthread_mutex_t c_pdu_buf_mut;
@@ -153,18 +259,39 @@ struct hiios {
   struct c_pdu_buf* free_c_pdu_bufs;
 #endif
 
+  /* The todo queue is an intrusive MPSC list (see hiios.c). Producers never lock,
+   * todo_mut only serializes the consumers (and parking on non-Linux). */
   pthread_mutex_t todo_mut;
-  pthread_cond_t todo_cond;
+  pthread_cond_t todo_cond;     /* parking when futex(2) is not available */
   struct hi_qel* todo_consume;  /* PDUs and I/O objects that need processing. */
-  struct hi_qel* todo_produce;
-  int n_todo;
+  struct hi_qel* volatile todo_produce;
+  struct hi_qel todo_stub;      /* dummy element so the queue is never truly empty */
+  volatile int n_todo;
+  volatile int n_idle;      /* threads parked waiting for work */
+  volatile int todo_seq;    /* bumped by every produce; futex word idle threads sleep on */
+  volatile int polling;     /* poll_tok is out: some thread is (or soon will be) in epoll_wait() */
   struct hi_qel poll_tok;
+  struct hi_qel wake_qel;   /* HI_WAKE marker for wake_fd in the poll set */
+  int wake_fd[2];           /* [0] is polled, [1] is written. Same fd for eventfd(2). */
+  pthread_mutex_t timer_mut;
+  long long tw_tick;        /* ms up to which timers have fired */
+  long long poll_until;     /* hi_poll() returns by then even without events */
+  unsigned long long tw_map[HI_TW_LEVELS];  /* bit set for each nonempty slot */
+  struct hi_timer* tw[HI_TW_LEVELS][HI_TW_SLOTS];
 };
 
 struct hi_thr {
   struct hiios* shf;
-  struct hi_pdu* free_pdus;
+  struct hi_pdu* free_pdus;   /* thread's PDU cache, linked by qel.n */
+  int n_free_pdus;
+  int pdu_hits;               /* not yet folded into shf->pool->pdu_hits */
+  struct hi_buf* free_bufs[HI_N_BUF_CLS];  /* thread's PDU buffer caches */
+  int n_free_bufs[HI_N_BUF_CLS];
   struct c_pdu_buf* free_c_pdu_bufs;
+  int n_flush;
+  struct hi_io* flush[HI_FLUSH_MAX];  /* ios sent to during current todo item, see hi_send0() */
+  struct hi_io* pin;          /* io pinned by this thread, see hi_pin() */
+  int n_pin;                  /* nesting depth of pin */
 };
 
 struct hi_host_spec {
@@ -188,11 +315,21 @@ extern struct hi_proto prototab[];
 void nonblock(int fd);
 
 struct hiios* hi_new_shuffler(int nfd, int npdu);
+struct hiios* hi_new_shard(struct hiios* pool);
 struct hi_io* hi_open_listener(struct hiios* shf, struct hi_host_spec* hs, int proto);
 struct hi_io* hi_open_tcp(struct hiios* shf, struct hi_host_spec* hs, int proto);
 struct hi_io* hi_add_fd(struct hiios* shf, int fd, int proto, int kind, char *description);
+struct hi_io* hi_io_slot(struct hiios* shf, int fd);
 
-struct hi_pdu* hi_pdu_alloc(struct hi_thr* hit);
+extern int hi_buf_cls_size[HI_N_BUF_CLS];
+struct hi_pdu* hi_pdu_alloc(struct hi_thr* hit, int size);
+int hi_pdu_grow(struct hi_thr* hit, struct hi_pdu* pdu, int size);
+void hi_pdu_unshare(struct hi_thr* hit, struct hi_pdu* pdu);
+void hi_pdu_free(struct hi_thr* hit, struct hi_pdu* pdu);
+void hi_pdu_hold(struct hi_pdu* pdu);
+void hi_pdu_release(struct hi_thr* hit, struct hi_pdu* pdu);
+void hi_buf_free(struct hi_thr* hit, char* mem, int cls);
+void hi_pdu_mem_free(struct hi_thr* hit, struct hi_pdu* pdu);
 void hi_send(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, struct hi_pdu* resp);
 void hi_send1(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, struct hi_pdu* resp,
 	      int len0, char* d0);
@@ -201,7 +338,15 @@ void hi_send2(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, struct h
 void hi_send3(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, struct hi_pdu* resp,
 	      int len0, char* d0, int len1, char* d1, int len2, char* d2);
 void hi_sendf(struct hi_thr* hit, struct hi_io* io, char* fmt, ...);
+int hi_pin(struct hi_thr* hit, struct hi_io* io);
+void hi_unpin(struct hi_thr* hit, struct hi_io* io);
 void hi_todo_produce(struct hiios* shf, struct hi_qel* qe);
+struct hi_qel* hi_todo_consume(struct hiios* shf);
+void hi_timer_arm(struct hiios* shf, struct hi_timer* t, long long ms);
+void hi_timer_cancel(struct hiios* shf, struct hi_timer* t);
+void hi_wake_at(struct hi_io* io, long long usec);
+long long hi_now_us();
+long long hi_now_ms();
 void hi_shuffle(struct hi_thr* hit, struct hiios* shf);
 
 /* Internal APIs */
@@ -213,12 +358,19 @@ void hi_process(struct hi_thr* hit, struct hi_pdu* pdu);
 void hi_in_out( struct hi_thr* hit, struct hi_io* io);
 void hi_close(  struct hi_thr* hit, struct hi_io* io);
 void hi_write(  struct hi_thr* hit, struct hi_io* io);
+void hi_flush(  struct hi_thr* hit);
+void hi_flush_add(struct hi_thr* hit, struct hi_io* io);
+#ifdef HAVE_IO_URING
+void hi_ur_writev(struct hi_io* io);
+void hi_ur_submit(struct hiios* shf);
+#endif
 void hi_read(   struct hi_thr* hit, struct hi_io* io);
 
 void hi_checkmore(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int minlen);
 
 void hi_free_req(struct hi_thr* hit, struct hi_pdu* pdu);
 void hi_free_req_fe(struct hi_thr* hit, struct hi_pdu* req);
+void hi_drop_writes(struct hi_thr* hit, struct hi_io* io);
 void hi_add_to_reqs(struct hi_io* io, struct hi_pdu* req);
 
 #endif /* _hiios_h */
@@ -14,52 +14,291 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
 #include "afr.h"
 #include "hiios.h"
 #include "errmac.h"
 #include "s5066.h"
 
-struct hi_pdu* hi_pdu_alloc(struct hi_thr* hit)
+/* Grow the pool by HI_PDU_CHUNK PDUs, cut into magazines in the depot.
+ * PDUs are never freed back to malloc, thus they never move. Caller holds pdu_mut. */
+
+static void hi_pdu_new_chunk(struct hiios* pool)
+{
+  struct hi_pdu* pdus;
+  int i;
+  ZMALLOCN(pdus, sizeof(struct hi_pdu) * HI_PDU_CHUNK);
+  for (i = HI_PDU_CHUNK - 1; i >= 0; --i) {
+    pthread_mutex_init(&pdus[i].qel.mut, MUTEXATTR);
+    if (i % HI_PDU_MAG != HI_PDU_MAG - 1)
+      pdus[i].qel.n = (struct hi_qel*)(pdus + i + 1);
+    if (!(i % HI_PDU_MAG)) {
+      pdus[i].len = HI_PDU_MAG;
+      pdus[i].n = pool->free_pdus;
+      pool->free_pdus = pdus + i;
+    }
+  }
+  pool->n_pdus += HI_PDU_CHUNK;
+  pool->n_free_pdus += HI_PDU_CHUNK;
+  D("new pdu chunk n_pdus=%d max_pdus=%d", pool->n_pdus, pool->max_pdus);
+}
+
+/* Take one magazine from the depot and put it in front of the thread cache.
+ * This is the only time the allocation path takes pdu_mut. If io is given,
+ * the PDU is for reading from network and the -npdu ceiling applies: rather
+ * than growing the pool, io is parked on pdu_waiters. This stops reading
+ * from it, so TCP flow control pushes back on the sender. */
+
+static void hi_pdu_refill(struct hi_thr* hit, struct hi_io* io)
 {
+  struct hiios* pool = hit->shf->pool;
+  struct hi_pdu* mag;
   struct hi_pdu* pdu;
-  if (hit->free_pdus) {
-    pdu = hit->free_pdus;
-    hit->free_pdus = (struct hi_pdu*)pdu->qel.n;
-    D("alloc pdu(%p) from thread", pdu);
-    goto retpdu;
+  LOCK(pool->pdu_mut, "pdu_refill");
+  pool->pdu_hits += hit->pdu_hits;
+  hit->pdu_hits = 0;
+  ++pool->pdu_misses;
+  if (!pool->free_pdus && (!io || pool->n_pdus < pool->max_pdus))
+    hi_pdu_new_chunk(pool);
+  mag = pool->free_pdus;
+  if (!mag) {
+    ++pool->pdu_depot_empty;
+    if (io && !io->pdu_wait) {
+      io->pdu_wait = 1;
+      io->pdu_wait_n = pool->pdu_waiters;
+      pool->pdu_waiters = io;
+    }
+    UNLOCK(pool->pdu_mut, "pdu_refill empty");
+    return;
   }
+  pool->free_pdus = mag->n;
+  pool->n_free_pdus -= mag->len;
+  UNLOCK(pool->pdu_mut, "pdu_refill");
+  
+  hit->n_free_pdus += mag->len;
+  for (pdu = mag; pdu->qel.n; pdu = (struct hi_pdu*)pdu->qel.n) ;
+  pdu->qel.n = (struct hi_qel*)hit->free_pdus;
+  hit->free_pdus = mag;
+  D("refill mag(%p) len=%d cache=%d", mag, mag->len, hit->n_free_pdus);
+}
+
+/* PDU buffer size classes. Smallest ones cover SIS primitives without payload,
+ * DTS headers, and SMTP replies. HI_PDU_MEM is the default read buffer. */
+
+int hi_buf_cls_size[HI_N_BUF_CLS] = { 64, 256, HI_PDU_MEM, HI_PDU_MEM_MAX };
+
+static int hi_buf_cls(int size)
+{
+  int cls;
+  for (cls = 0; cls < HI_N_BUF_CLS; ++cls)
+    if (size <= hi_buf_cls_size[cls])
+      return cls;
+  return -1;
+}
+
+/* Buffers are handled in magazines like PDUs, see hi_pdu_refill(). When the
+ * depot runs dry, a new magazine is malloc'd, thus only PDU headers are
+ * limited by -npdu and the buffer pools grow to the peak need of each class. */
 
-  LOCK(hit->shf->pdu_mut, "pdu_alloc");
-  if (hit->shf->free_pdus) {
-    pdu = hit->shf->free_pdus;
-    hit->free_pdus = (struct hi_pdu*)pdu->qel.n;
-    UNLOCK(hit->shf->pdu_mut, "pdu_alloc ok");
-    D("alloc pdu(%p) from shuffler", pdu);
-    goto retpdu;
+static char* hi_buf_alloc(struct hi_thr* hit, int cls)
+{
+  struct hiios* pool = hit->shf->pool;
+  struct hi_buf* mag;
+  struct hi_buf* buf;
+  char* p;
+  int i, size;
+  
+  if (!hit->free_bufs[cls]) {
+    LOCK(pool->pdu_mut, "buf_refill");
+    mag = pool->free_bufs[cls];
+    if (mag) {
+      pool->free_bufs[cls] = mag->mag;
+    } else
+      pool->n_bufs[cls] += HI_PDU_MAG;
+    UNLOCK(pool->pdu_mut, "buf_refill");
+    if (!mag) {
+      size = hi_buf_cls_size[cls];
+      MALLOCN(p, size * HI_PDU_MAG);
+      for (i = 0; i < HI_PDU_MAG - 1; ++i)
+	((struct hi_buf*)(p + i*size))->n = (struct hi_buf*)(p + (i+1)*size);
+      ((struct hi_buf*)(p + i*size))->n = 0;
+      mag = (struct hi_buf*)p;
+      mag->len = HI_PDU_MAG;
+      D("new bufs cls(%d) size=%d", cls, size);
+    }
+    hit->free_bufs[cls] = mag;
+    hit->n_free_bufs[cls] = mag->len;
   }
-  UNLOCK(hit->shf->pdu_mut, "pdu_alloc no pdu");
   
-  D("out of pdus %d", 0);
-  return 0;
+  buf = hit->free_bufs[cls];
+  hit->free_bufs[cls] = buf->n;
+  --hit->n_free_bufs[cls];
+  return (char*)buf;
+}
+
+/* Start a shared read buffer, see HI_BUF_SHARED. Its data begins at returned
+ * pointer plus HI_BUF_HDR. */
+
+static char* hi_buf_alloc_shared(struct hi_thr* hit)
+{
+  char* mem = hi_buf_alloc(hit, HI_N_BUF_CLS - 1);
+  *(int*)mem = 1;
+  return mem;
+}
 
- retpdu:
-  pdu->lim = pdu->mem + HI_PDU_MEM;
-  pdu->m = pdu->scan = pdu->ap = pdu->mem;
+/* Allocate a PDU with at least size bytes of buffer. Size 0 means the PDU is only
+ * a handle for sending data that lives elsewhere (see hi_send1()). Only
+ * hi_read() and hi_checkmore() pass io, see hi_pdu_refill(). Others may exceed
+ * -npdu: failing them midway through processing would be worse. The PDUs
+ * hi_read() gets have a shared buffer of the largest class, whatever the size. */
+
+static struct hi_pdu* hi_pdu_alloc0(struct hi_thr* hit, int size, struct hi_io* io)
+{
+  struct hi_pdu* pdu;
+  int cls = 0;
+  if (size && !io && (cls = hi_buf_cls(size)) == -1) {
+    ERR("PDU size(%d) exceeds HI_PDU_MEM_MAX(%d)", size, HI_PDU_MEM_MAX);
+    return 0;
+  }
+  
+  if (hit->n_free_pdus <= HI_PDU_CACHE_LO)
+    hi_pdu_refill(hit, io);
+  else
+    ++hit->pdu_hits;
+  
+  pdu = hit->free_pdus;
+  if (!pdu) {
+    D("out of pdus hits=%d misses=%d flushes=%d empty=%d", hit->shf->pool->pdu_hits,
+      hit->shf->pool->pdu_misses, hit->shf->pool->pdu_flushes, hit->shf->pool->pdu_depot_empty);
+    return 0;
+  }
+  hit->free_pdus = (struct hi_pdu*)pdu->qel.n;
+  --hit->n_free_pdus;
+  D("alloc pdu(%p) size=%d", pdu, size);
+  
+  if (io && size) {
+    pdu->mem = hi_buf_alloc_shared(hit);
+    pdu->mem_cls = (HI_N_BUF_CLS - 1) | HI_BUF_SHARED;
+    pdu->lim = pdu->mem + HI_PDU_MEM_MAX;
+    pdu->m = pdu->scan = pdu->ap = pdu->mem + HI_BUF_HDR;
+  } else {
+    if (size) {
+      pdu->mem = hi_buf_alloc(hit, cls);
+      pdu->mem_cls = cls;
+      pdu->lim = pdu->mem + hi_buf_cls_size[cls];
+    } else
+      pdu->lim = pdu->mem = 0;
+    pdu->m = pdu->scan = pdu->ap = pdu->mem;
+  }
   pdu->req = pdu->parent = pdu->subresps = pdu->reals = pdu->synths = 0;
   pdu->fe = 0;
+  pdu->refs = 0;
+  pdu->qel.flags = 0;
   pdu->need = 1;  /* trigger network I/O */
   pdu->n = 0;
   return pdu;
 }
 
-/* As hi_checkmore() will cause cur_pdu to change, it is common to call hi_add_reqs() */
+struct hi_pdu* hi_pdu_alloc(struct hi_thr* hit, int size)
+{
+  return hi_pdu_alloc0(hit, size, 0);
+}
+
+/* Move PDU contents to a buffer of at least size bytes. Called from hi_read() when
+ * the decoder asks for more than the buffer can hold, or when a shared buffer is
+ * running out of room. Pointers into the old buffer, other than scan and ap, are
+ * not adjusted, thus this must be done before the decoder has completed the PDU.
+ * A shared buffer is replaced with a fresh shared buffer, leaving the old one to
+ * the other PDUs that are views to it. Returns 0 on failure. */
+
+int hi_pdu_grow(struct hi_thr* hit, struct hi_pdu* pdu, int size)
+{
+  char* mem;
+  char* m;
+  int cls;
+  if (pdu->mem && pdu->mem_cls & HI_BUF_SHARED) {
+    if (size > HI_PDU_MEM_MAX - HI_BUF_HDR) {
+      ERR("PDU size(%d) exceeds HI_PDU_MEM_MAX(%d)", size, HI_PDU_MEM_MAX - HI_BUF_HDR);
+      return 0;
+    }
+    cls = HI_N_BUF_CLS - 1;
+    mem = hi_buf_alloc_shared(hit);
+    m = mem + HI_BUF_HDR;
+  } else {
+    if ((cls = hi_buf_cls(size)) == -1) {
+      ERR("PDU size(%d) exceeds HI_PDU_MEM_MAX(%d)", size, HI_PDU_MEM_MAX);
+      return 0;
+    }
+    m = mem = hi_buf_alloc(hit, cls);
+  }
+  D("grow pdu(%p) %d -> %d", pdu, (int)(pdu->lim - pdu->m), hi_buf_cls_size[cls] - (int)(m - mem));
+  memcpy(m, pdu->m, pdu->ap - pdu->m);
+  pdu->scan = m + (pdu->scan - pdu->m);
+  pdu->ap = m + (pdu->ap - pdu->m);
+  if (pdu->mem) {
+    cls |= pdu->mem_cls & HI_BUF_SHARED;
+    hi_pdu_mem_free(hit, pdu);
+  }
+  pdu->mem = mem;
+  pdu->m = m;
+  pdu->mem_cls = cls;
+  pdu->lim = mem + hi_buf_cls_size[cls & ~HI_BUF_SHARED];
+  return 1;
+}
+
+/* Move a PDU that is a view to a shared read buffer (see hi_checkmore()) to a
+ * buffer of its own size class. Called before a PDU is held past its decode, e.g.
+ * a SIS request while ARQ waits for ACKs, or an out of order D_PDU in rx_pdus[],
+ * which would otherwise pin the whole read buffer. As with hi_pdu_grow(), the
+ * caller must adjust any other pointers it keeps into the old buffer. */
+
+void hi_pdu_unshare(struct hi_thr* hit, struct hi_pdu* pdu)
+{
+  char* mem;
+  int cls, n = pdu->ap - pdu->m;
+  if (!pdu->mem || !(pdu->mem_cls & HI_BUF_SHARED)
+      || (cls = hi_buf_cls(n)) == HI_N_BUF_CLS - 1)  /* as big as the shared buffer */
+    return;
+  mem = hi_buf_alloc(hit, cls);
+  D("unshare pdu(%p) %d bytes to cls(%d)", pdu, n, cls);
+  memcpy(mem, pdu->m, n);
+  pdu->scan = mem + (pdu->scan - pdu->m);
+  pdu->ap = mem + n;
+  hi_pdu_mem_free(hit, pdu);
+  pdu->mem = pdu->m = mem;
+  pdu->mem_cls = cls;
+  pdu->lim = mem + hi_buf_cls_size[cls];
+}
+
+/* Called by decoder once req is complete (req->len known). Bytes read past its end
+ * belong to next PDU, which becomes cur_pdu. With a shared read buffer the next PDU
+ * is just a view to the rest of the same buffer and further reads go after it, so
+ * a burst of pipelined PDUs is read with one read(2) and nothing is copied.
+ * As hi_checkmore() will cause cur_pdu to change, it is common to call hi_add_reqs() */
 
 void hi_checkmore(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int minlen)
 {
   int n = req->ap - req->m;
+  struct hi_pdu* nreq;
   ASSERT(minlen);  /* If this is ever zero it will prevent hi_poll() from producing. */
+  if (req->mem && req->mem_cls & HI_BUF_SHARED) {
+    nreq = hi_pdu_alloc0(hit, 0, io);
+    if (!nreq)  /* io is parked, see hi_read0(), but what was read must be kept */
+      nreq = hi_pdu_alloc(hit, 0);
+    if (!nreq) { NEVERNEVER("*** out of pdus in bad place %d", n); }
+    __sync_add_and_fetch((int*)req->mem, 1);
+    nreq->mem = req->mem;
+    nreq->mem_cls = req->mem_cls;
+    nreq->m = nreq->scan = req->m + req->len;
+    nreq->ap = req->ap;
+    nreq->lim = req->lim;
+    nreq->need = minlen;
+    io->cur_pdu = nreq;
+    req->ap = req->lim = req->m + req->len;
+    return;
+  }
   if (n > req->len) {
-    struct hi_pdu* nreq = hi_pdu_alloc(hit);
+    nreq = hi_pdu_alloc(hit, MAX(n - req->len, HI_PDU_MEM));
     if (!nreq) { NEVERNEVER("*** out of pdus in bad place %d", n); }
     nreq->need = minlen;
     memcpy(nreq->ap, req->m + req->len, n - req->len);
@@ -70,20 +309,25 @@ void hi_checkmore(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int
     io->cur_pdu = 0;
 }
 
-void hi_read(struct hi_thr* hit, struct hi_io* io)
+static void hi_read0(struct hi_thr* hit, struct hi_io* io)
 {
   int ret;
   while (1) {  /* eagerly read until we exhaust the read (c.f. edge triggered epoll) */
+    if (io->pdu_wait)
+      return;  /* parked by hi_checkmore(), hi_pdu_free() will reschedule io */
     if (!io->cur_pdu) {  /* need to create a new PDU */
-      io->cur_pdu = hi_pdu_alloc(hit);
-      if (!io->cur_pdu) {
-	/* Allocation failure, retry later. Back to todo because we did not exhaust read */
-	hi_todo_produce(hit->shf, &io->qel);
-	return;
-      }
+      io->cur_pdu = hi_pdu_alloc0(hit, HI_PDU_MEM_MAX, io);
+      if (!io->cur_pdu)
+	return;  /* io was parked, hi_pdu_free() will reschedule it (we did not exhaust read) */
       ++io->n_pdu_in;
       /* set fe? */
     }
+    if ((io->cur_pdu->need > io->cur_pdu->lim - io->cur_pdu->m
+	 || io->cur_pdu->mem_cls & HI_BUF_SHARED
+	 && io->cur_pdu->lim - io->cur_pdu->ap < HI_READ_MIN
+	 && io->cur_pdu->m > io->cur_pdu->mem + HI_BUF_HDR)
+	&& !hi_pdu_grow(hit, io->cur_pdu, io->cur_pdu->need))
+      goto conn_close;
   retry:
     D("read(%x)", io->fd);
     ret = read(io->fd, io->cur_pdu->ap, io->cur_pdu->lim - io->cur_pdu->ap); /* *** vs. need */
@@ -108,6 +352,7 @@ void hi_read(struct hi_thr* hit, struct hi_io* io)
       HEXDUMP("got: ", io->cur_pdu->ap, io->cur_pdu->ap + ret, 800);
       io->cur_pdu->ap += ret;
       io->n_read += ret;
+      io->last_io = time(0);
       while (io->cur_pdu
 	     && io->cur_pdu->need   /* no further I/O desired */
 	     && io->cur_pdu->need <= (io->cur_pdu->ap - io->cur_pdu->m)) {
@@ -140,4 +385,23 @@ void hi_read(struct hi_thr* hit, struct hi_io* io)
   hi_close(hit, io);
 }
 
+/* Only one thread at a time reads an io, see hi_write() for why and how. */
+
+void hi_read(struct hi_thr* hit, struct hi_io* io)
+{
+  if (!__sync_bool_compare_and_swap(&io->reading, 0, hit)) {
+    io->read_again = 1;
+    __sync_synchronize();
+    if (!__sync_bool_compare_and_swap(&io->reading, 0, hit))
+      return;  /* owner will see read_again */
+  }
+  do {
+    io->read_again = 0;
+    hi_read0(hit, io);
+    __sync_lock_release(&io->reading);
+    __sync_synchronize();
+  } while (io->read_again && !(io->fd & 0x80000000) && !io->closing
+	   && __sync_bool_compare_and_swap(&io->reading, 0, hit));
+}
+
 /* EOF  --  hiread.c */
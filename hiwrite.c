@@ -5,14 +5,17 @@
  * 15.4.2006, created over Easter holiday --Sampo
  * 22.4.2006, refined multi iov sends over the weekend --Sampo
  *
- * Idea: Consider separate lock for maintenance of to_write queue and separate
- * for in_write, iov, and actual wrintev().
+ * Senders on any thread push PDUs to to_write_in without locking. Whichever
+ * thread is writing the io owns in_write, iov, and the to_write queue, to
+ * which it moves what was pushed. See hi_send0() and hi_write().
  */
 
 #include <pthread.h>
 #include <memory.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -23,30 +26,84 @@
 #include "hiios.h"
 #include "errmac.h"
 
+/* Rather than writing each PDU as it is sent, the thread remembers the io and
+ * writes once it is done with the todo item, see hi_flush(). Thus e.g. the
+ * confirms to a burst of SIS requests go out in one writev(2). */
+
+void hi_flush_add(struct hi_thr* hit, struct hi_io* io)
+{
+  int i;
+  for (i = 0; i < hit->n_flush; ++i)
+    if (hit->flush[i] == io)
+      return;
+  if (hit->n_flush == HI_FLUSH_MAX) {
+    /* Fanned out to too many. Not written right away: the sender may hold
+     * protocol locks, e.g. dts->mut, that hi_close() of a failed io takes. */
+    hi_todo_produce(io->shf, &io->qel);
+    return;
+  }
+  hit->flush[hit->n_flush++] = io;
+}
+
+/* Keep io from being closed while this thread sends to it. hi_close() raises
+ * closing and then waits for the pins to drain, thus a sender either sees closing
+ * and gives up, or its PDU is on to_write_in before hi_drop_writes() runs. A thread
+ * may close the io it has pinned itself, e.g. from hi_write(), but only after its
+ * push. Pins nest. Returns 0 if io is closing. */
+
+int hi_pin(struct hi_thr* hit, struct hi_io* io)
+{
+  __sync_fetch_and_add(&io->n_pins, 1);  /* full barrier, pairs with CAS of closing */
+  if (io->closing) {
+    __sync_fetch_and_sub(&io->n_pins, 1);
+    return 0;
+  }
+  if (!hit->pin)
+    hit->pin = io;
+  if (hit->pin == io)
+    ++hit->n_pin;
+  return 1;
+}
+
+void hi_unpin(struct hi_thr* hit, struct hi_io* io)
+{
+  if (hit->pin == io && !--hit->n_pin)
+    hit->pin = 0;
+  __sync_fetch_and_sub(&io->n_pins, 1);
+}
+
 void hi_send0(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, struct hi_pdu* resp)
 {
   if (req) {
     resp->req = req;
+    LOCK(req->qel.mut, "add to reals");  /* resps of one req may be written by many threads */
     resp->n = req->reals;
     req->reals = resp;
+    UNLOCK(req->qel.mut, "add to reals");
+    hi_pdu_hold(req);
   } else {
     resp->req = resp->n = 0;
   }
+  hi_pdu_hold(resp);  /* released by hi_clear_iov() once written */
   
-  LOCK(io->qel.mut, "");
-  if (!io->to_write_produce)
-    io->to_write_consume = resp;
-  else
-    io->to_write_produce->qel.n = &resp->qel;
-  io->to_write_produce = resp;
-  resp->qel.n = 0;
-  ++io->n_to_write;
-  ++io->n_pdu_out;
-  UNLOCK(io->qel.mut, "");
+  if ((io->fd & 0x80000000) || !hi_pin(hit, io)) {  /* e.g. io from lock free saptab */
+    D("drop pdu(%p) to closed fd(%x)", resp, io->fd);
+    hi_pdu_release(hit, resp);
+    return;
+  }
+  __sync_fetch_and_add(&io->n_to_write, 1);  /* before the push, so it never goes negative */
+  __sync_fetch_and_add(&io->n_pdu_out, 1);
+  do
+    resp->wn = io->to_write_in;
+  while (!__sync_bool_compare_and_swap(&io->to_write_in, resp->wn, resp));
+  hi_unpin(hit, io);
   
   D("hisend pdu(%p) fd(%x)", resp, io->fd);
-  hi_write(hit, io);   /* Try cranking the write machine right away! */
-  /*hi_todo_produce(hit->shf, &io->qel);*/
+  if (io->shf != hit->shf) {  /* io belongs to other shard: let its thread do the writev(2) */
+    hi_todo_produce(io->shf, &io->qel);
+    return;
+  }
+  hi_flush_add(hit, io);  /* crank the write machine once the todo item is done */
 }
 
 void hi_send(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, struct hi_pdu* resp)
@@ -96,7 +153,13 @@ void hi_send3(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, struct h
 void hi_sendf(struct hi_thr* hit, struct hi_io* io, char* fmt, ...)
 {
   va_list pv;
-  struct hi_pdu* pdu = hi_pdu_alloc(hit);
+  struct hi_pdu* pdu;
+  int len;
+  
+  va_start(pv, fmt);
+  len = vsnprintf(0, 0, fmt, pv);  /* size the buffer first: SMTP replies are tiny */
+  va_end(pv);
+  pdu = hi_pdu_alloc(hit, len + 1);
   if (!pdu) { ERR("Out of PDUs in bad place fmt(%s)", fmt); return; }
   
   va_start(pv, fmt);
@@ -107,27 +170,97 @@ void hi_sendf(struct hi_thr* hit, struct hi_io* io, char* fmt, ...)
   hi_send(hit, io, 0, pdu);
 }
 
-static void hi_make_iov(struct hi_io* io)
+/* Move what senders pushed to to_write_in to the end of to_write, in the order
+ * they were sent. HI_F_URGENT PDUs go behind other urgent ones, ahead of the
+ * rest. Only the thread that is writing the io calls this. */
+
+static void hi_take_to_write(struct hi_io* io)
+{
+  struct hi_pdu* pdu;
+  struct hi_pdu* nxt;
+  struct hi_pdu* fifo = 0;
+  for (pdu = __sync_lock_test_and_set(&io->to_write_in, 0); pdu; pdu = nxt) {
+    nxt = pdu->wn;  /* newest first: reverse */
+    pdu->wn = fifo;
+    fifo = pdu;
+  }
+  for (pdu = fifo; pdu; pdu = nxt) {
+    nxt = pdu->wn;
+    if (pdu->qel.flags & HI_F_URGENT) {
+      if (io->to_write_urgent) {
+	pdu->wn = io->to_write_urgent->wn;
+	io->to_write_urgent->wn = pdu;
+      } else {
+	pdu->wn = io->to_write_consume;
+	io->to_write_consume = pdu;
+      }
+      io->to_write_urgent = pdu;
+      if (!pdu->wn)
+	io->to_write_produce = pdu;
+    } else {
+      if (!io->to_write_produce)
+	io->to_write_consume = pdu;
+      else
+	io->to_write_produce->wn = pdu;
+      io->to_write_produce = pdu;
+      pdu->wn = 0;
+    }
+  }
+}
+
+/* Take as many PDUs from to_write as fit in iov. Late binding of headers, see
+ * dts_late_bind(), may take protocol locks. A PDU that late binding drops is
+ * released unsent. */
+
+static void hi_make_iov(struct hi_thr* hit, struct hi_io* io)
 {
   struct hi_pdu* pdu;
+  struct hi_pdu* first;
   struct iovec* lim = io->iov+HI_N_IOV;
-  struct iovec* cur = io->iov_cur = io->iov;
-  LOCK(io->qel.mut, "");
-  while ((pdu = io->to_write_consume) && (cur + pdu->n_iov) <= lim) {
-    memcpy(cur, pdu->iov, pdu->n_iov * sizeof(struct iovec));
-    cur += pdu->n_iov;
-    
-    if (!(io->to_write_consume = pdu->wn))    /* consume from to_write */
-      io->to_write_produce = 0;
-    --io->n_to_write;
-    pdu->wn = io->in_write;                   /* produce to in_write */
-    io->in_write = pdu;
+  struct iovec* cur;
+  int i, n_iov, remaining;
+  
+  do {
+    n_iov = remaining = 0;
+    if (io->to_write_in)
+      hi_take_to_write(io);
+    first = io->to_write_consume;
+    for (pdu = 0; io->to_write_consume && n_iov + io->to_write_consume->n_iov <= HI_N_IOV; ) {
+      pdu = io->to_write_consume;
+      n_iov += pdu->n_iov;
+      for (i = 0; i < pdu->n_iov; ++i)
+	remaining += pdu->iov[i].iov_len;
+      if (!(io->to_write_consume = pdu->wn))  /* consume from to_write */
+	io->to_write_produce = 0;
+      if (pdu == io->to_write_urgent)
+	io->to_write_urgent = 0;
+      __sync_fetch_and_sub(&io->n_to_write, 1);
+      ASSERT(io->n_to_write >= 0);
+    }
+    if (pdu)
+      pdu->wn = 0;
+    else
+      first = 0;
     
-    ASSERT(io->n_to_write >= 0);
-    ASSERT(pdu->n_iov && pdu->iov[0].iov_len);   /* Empty writes can lead to infinite loops */
-  }
-  UNLOCK(io->qel.mut, "");
-  io->n_iov = cur - io->iov_cur;
+    cur = io->iov_cur = io->iov;
+    while ((pdu = first)) {
+      first = pdu->wn;
+      if (io->qel.proto == S5066_DTS && !dts_late_bind(io, pdu, remaining)) {
+	remaining -= pdu->iov[0].iov_len;  /* ACK-ONLY, one iov */
+	pdu->wn = 0;
+	hi_pdu_release(hit, pdu);  /* hold of hi_send0() */
+	continue;
+      }
+      ASSERT(cur + pdu->n_iov <= lim);
+      memcpy(cur, pdu->iov, pdu->n_iov * sizeof(struct iovec));
+      for (i = 0; i < pdu->n_iov; ++i, ++cur)
+	remaining -= cur->iov_len;
+      pdu->wn = io->in_write;                 /* produce to in_write */
+      io->in_write = pdu;
+      ASSERT(pdu->n_iov && pdu->iov[0].iov_len);   /* Empty writes can lead to infinite loops */
+    }
+    io->n_iov = cur - io->iov_cur;
+  } while (!io->in_write && (io->to_write_consume || io->to_write_in));  /* all dropped, try the next batch */
 }
 
 /* *** Here complex determination about freeability of a PDU needs to be done.
@@ -138,13 +271,99 @@ static void hi_make_iov(struct hi_io* io)
  * c. possibility of sending a response before processing of request itself has ended
  */
 
+/* Return PDU to thread cache. If the cache grew above the high watermark, give
+ * one magazine worth back to the depot so other threads do not starve. If ios
+ * are waiting for PDUs (see hi_pdu_refill()), return what we have right away
+ * and reschedule the waiters. */
+
+void hi_pdu_free(struct hi_thr* hit, struct hi_pdu* pdu)
+{
+  struct hiios* pool = hit->shf->pool;
+  struct hi_pdu* mag;
+  struct hi_pdu* last;
+  struct hi_io* io;
+  struct hi_io* nxt;
+  int i, n;
+  if (pdu->mem) {
+    hi_pdu_mem_free(hit, pdu);
+    pdu->lim = pdu->ap = pdu->m = pdu->mem = 0;
+  }
+  pdu->qel.n = (struct hi_qel*)hit->free_pdus;
+  hit->free_pdus = pdu;
+  if (++hit->n_free_pdus <= HI_PDU_CACHE_HI && !pool->pdu_waiters)
+    return;
+  
+  n = MIN(hit->n_free_pdus, HI_PDU_MAG);
+  mag = hit->free_pdus;
+  for (last = mag, i = 1; i < n; ++i)
+    last = (struct hi_pdu*)last->qel.n;
+  hit->free_pdus = (struct hi_pdu*)last->qel.n;
+  hit->n_free_pdus -= n;
+  last->qel.n = 0;
+  mag->len = n;
+  
+  LOCK(pool->pdu_mut, "pdu_flush");
+  mag->n = pool->free_pdus;
+  pool->free_pdus = mag;
+  pool->n_free_pdus += n;
+  ++pool->pdu_flushes;
+  for (io = pool->pdu_waiters; io; io = nxt) {
+    nxt = io->pdu_wait_n;
+    io->pdu_wait = 0;
+    hi_todo_produce(io->shf, &io->qel);
+  }
+  pool->pdu_waiters = 0;
+  UNLOCK(pool->pdu_mut, "pdu_flush");
+  D("flush mag(%p) len=%d cache=%d", mag, n, hit->n_free_pdus);
+}
+
+/* Drop PDU's reference to its buffer. Shared read buffer is freed once the last
+ * PDU viewing it is done, see hi_checkmore(). */
+
+void hi_pdu_mem_free(struct hi_thr* hit, struct hi_pdu* pdu)
+{
+  if (!(pdu->mem_cls & HI_BUF_SHARED))
+    hi_buf_free(hit, pdu->mem, pdu->mem_cls);
+  else if (!__sync_sub_and_fetch((int*)pdu->mem, 1))
+    hi_buf_free(hit, pdu->mem, pdu->mem_cls & ~HI_BUF_SHARED);
+}
+
+/* Same for PDU buffers, see hi_buf_alloc() */
+
+void hi_buf_free(struct hi_thr* hit, char* mem, int cls)
+{
+  struct hiios* pool;
+  struct hi_buf* buf = (struct hi_buf*)mem;
+  struct hi_buf* last;
+  int i;
+  buf->n = hit->free_bufs[cls];
+  hit->free_bufs[cls] = buf;
+  if (++hit->n_free_bufs[cls] <= HI_PDU_CACHE_HI)
+    return;
+  
+  for (last = buf, i = 1; i < HI_PDU_MAG; ++i)
+    last = last->n;
+  hit->free_bufs[cls] = last->n;
+  hit->n_free_bufs[cls] -= HI_PDU_MAG;
+  last->n = 0;
+  buf->len = HI_PDU_MAG;
+  
+  pool = hit->shf->pool;
+  LOCK(pool->pdu_mut, "buf_flush");
+  buf->mag = pool->free_bufs[cls];
+  pool->free_bufs[cls] = buf;
+  UNLOCK(pool->pdu_mut, "buf_flush");
+}
+
 void hi_free_resp(struct hi_thr* hit, struct hi_pdu* resp)
 {
-  struct hi_pdu* pdu = resp->req->reals;
+  struct hi_pdu* pdu;
   
   /* Remove resp from request's real response list. resp MUST be in this list: if it
    * is not, pdu-n (next) pointer chasing will lead to NULL dereference (by design). */
   
+  LOCK(resp->req->qel.mut, "del from reals");
+  pdu = resp->req->reals;
   if (resp == pdu)
     resp->req->reals = pdu->n;
   else
@@ -153,9 +372,9 @@ void hi_free_resp(struct hi_thr* hit, struct hi_pdu* resp)
 	pdu->n = resp->n;
 	break;
       }
+  UNLOCK(resp->req->qel.mut, "del from reals");
   
-  resp->qel.n = (struct hi_qel*)(hit->free_pdus);         /* move to free list */
-  hit->free_pdus = resp;
+  hi_pdu_free(hit, resp);
   D("resp(%p) freed", resp);
 }
 
@@ -164,31 +383,24 @@ void hi_free_resp(struct hi_thr* hit, struct hi_pdu* resp)
 void hi_free_req(struct hi_thr* hit, struct hi_pdu* req)
 {
   struct hi_pdu* pdu;
+  struct hi_pdu* nxt;
   
-  for (pdu = req->reals; pdu; pdu = pdu->n) { /* free dependent resps */
-    pdu->qel.n = &hit->free_pdus->qel;
-    hit->free_pdus = pdu;
+  for (pdu = req->reals; pdu; pdu = nxt) { /* free dependent resps */
+    nxt = pdu->n;
+    hi_pdu_free(hit, pdu);
   }
   
-  req->qel.n = (struct hi_qel*)(hit->free_pdus);          /* move to free list */
-  hit->free_pdus = req;
+  hi_pdu_free(hit, req);
   D("req(%p) freed", req);
 }
 
-void hi_free_req_fe(struct hi_thr* hit, struct hi_pdu* req)
+/* Unlink req from reqs of its frontend. The theory is that this only gets called
+ * when its known that the request is in the queue. If it is not, the loop will
+ * run off the end and crash with NULL pointer. Caller holds req->fe->qel.mut. */
+
+static void hi_del_from_reqs(struct hi_pdu* req)
 {
-  struct hi_pdu* pdu;
-  hi_free_req(hit, req);
-  ASSERT(req->fe);
-  if (!req->fe)
-    return;
-  
-  /* Scan the frontend to find the reference. The theory is that
-   * hi_free_req_fe() only gets called when its known that the request is in the queue.
-   * If it is not, the loop will run off the end and crash with NULL pointer. */
-  
-  LOCK(req->fe->qel.mut, "del from reqs");
-  pdu = req->fe->reqs;
+  struct hi_pdu* pdu = req->fe->reqs;
   if (pdu == req)
     req->fe->reqs = req->n;
   else
@@ -197,7 +409,58 @@ void hi_free_req_fe(struct hi_thr* hit, struct hi_pdu* req)
 	pdu->n = req->n;
 	break;
       }
+}
+
+void hi_free_req_fe(struct hi_thr* hit, struct hi_pdu* req)
+{
+  ASSERT(req->fe);
+  if (!req->fe) {
+    hi_free_req(hit, req);
+    return;
+  }
+  
+  /* N.B. This must happen before the PDU is freed as hi_pdu_free() may reuse req->n. */
+  
+  LOCK(req->fe->qel.mut, "del from reqs");
+  hi_del_from_reqs(req);
   UNLOCK(req->fe->qel.mut, "del from reqs");
+  hi_free_req(hit, req);
+}
+
+/* A PDU is referenced by the write queues while it is sent (see hi_send0()), by
+ * each response that depends on it (resp->req), and by holds of senders that
+ * still need it, e.g. a SIS request while its payload is segmented to DTS.
+ * When the last reference goes, a response is freed and releases its request,
+ * a request is freed along with its frontend bookkeeping. */
+
+void hi_pdu_hold(struct hi_pdu* pdu)
+{
+  __sync_fetch_and_add(&pdu->refs, 1);
+}
+
+void hi_pdu_release(struct hi_thr* hit, struct hi_pdu* pdu)
+{
+  struct hi_pdu* req;
+  struct hi_io* fe;
+  if ((req = pdu->req)) {
+    if (__sync_sub_and_fetch(&pdu->refs, 1))
+      return;
+    hi_free_resp(hit, pdu);
+    hi_pdu_release(hit, req);
+  } else if ((fe = pdu->fe)) {
+    /* Last reference to a request in reqs is dropped under the frontend lock
+     * so that hi_close() of the frontend, in other thread, sees either a
+     * reference or the request gone from reqs, never a request being freed. */
+    LOCK(fe->qel.mut, "release req");
+    if (__sync_sub_and_fetch(&pdu->refs, 1)) {
+      UNLOCK(fe->qel.mut, "release req");
+      return;
+    }
+    hi_del_from_reqs(pdu);
+    UNLOCK(fe->qel.mut, "release req");
+    hi_free_req(hit, pdu);
+  } else if (!__sync_sub_and_fetch(&pdu->refs, 1))
+    hi_free_req(hit, pdu);
 }
 
 /* Often moving PDU to reqs means it should stop being cur_pdu. This is either
@@ -216,6 +479,7 @@ static void hi_clear_iov(struct hi_thr* hit, struct hi_io* io, int n)
 {
   struct hi_pdu* pdu;
   io->n_written += n;
+  io->last_io = time(0);
   while (io->n_iov && n) {
     if (n >= io->iov_cur->iov_len) {
       n -= io->iov_cur->iov_len;
@@ -240,31 +504,115 @@ static void hi_clear_iov(struct hi_thr* hit, struct hi_io* io, int n)
     io->in_write = pdu->wn;
     pdu->wn = 0;
     
-    if (!pdu->req) continue;
+    /* Drop the hold of hi_send0(). The last reference to a response frees it
+     * and, if this was the last response, the request, see hi_pdu_release(). */
     
-    /* Only a response can cause anything freed, and every response is freeable upon write. */
-    
-    hi_free_resp(hit, pdu);
-    if (!pdu->req->reals)
-      hi_free_req(hit, pdu->req);  /* last response, free the request */
+    hi_pdu_release(hit, pdu);
   }
 }
 
-/* This function can only be called by one thread at a time because the todo_queue
- * only admits an io object once and only one thread can consume it. Thus locking
- * is really needed only to protect the to_write queue, see hi_make_iov(). */
+/* Release what is left to write on an io that is being closed, so that the
+ * slot does not write it to the next connection. Caller owns the io. */
 
-void hi_write(struct hi_thr* hit, struct hi_io* io)
+void hi_drop_writes(struct hi_thr* hit, struct hi_io* io)
+{
+  struct hi_pdu* pdu;
+  hi_take_to_write(io);
+  io->n_iov = 0;
+  while ((pdu = io->in_write)) {
+    io->in_write = pdu->wn;
+    pdu->wn = 0;
+    hi_pdu_release(hit, pdu);
+  }
+  while ((pdu = io->to_write_consume)) {
+    io->to_write_consume = pdu->wn;
+    pdu->wn = 0;
+    __sync_fetch_and_sub(&io->n_to_write, 1);
+    hi_pdu_release(hit, pdu);
+  }
+  io->to_write_produce = io->to_write_urgent = 0;
+}
+
+#ifdef TCP_CORK
+/* Data sent with MSG_MORE waits for the next batch, but dts_late_bind() may
+ * have dropped all of that batch, e.g. it only had ACK-ONLY D_PDUs. An empty
+ * send does not push the pending segment, clearing TCP_CORK does (see `man 7 tcp'). */
+
+static void hi_uncork(struct hi_io* io)
+{
+  int off = 0;
+  io->corked = 0;
+  D("uncork(%x)", io->fd);
+  if (setsockopt(io->fd, IPPROTO_TCP, TCP_CORK, (char*)&off, sizeof(off)) == -1)
+    D("setsockopt(TCP_CORK, 0) on fd(%x): %d %s", io->fd, errno, STRERROR(errno));
+}
+#endif
+
+/* Write until exhausted or everything is written. Caller owns the io, see hi_write().
+ * If more than one iov worth is queued, e.g. a train of D_PDUs, the batches
+ * but the last are sent with MSG_MORE so TCP packs them into full segments. */
+
+static void hi_write0(struct hi_thr* hit, struct hi_io* io)
 {
   int ret;
+#ifdef MSG_MORE
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+#endif
   while (1) {   /* Write until exhausted! */
+#ifdef HAVE_IO_URING
+    if (io->ur_write) {  /* -uring: writev was submitted, see hi_ur_writev() */
+      if (io->ur_write == 1)
+	return;  /* still in flight, completion brings us back */
+      io->ur_write = 0;
+      if (io->ur_close) {
+	hi_clear_iov(hit, io, io->ur_wres > 0 ? io->ur_wres : 0);
+	hi_close(hit, io);
+	return;
+      }
+      if ((ret = io->ur_wres) < 0) {
+	errno = -ret;
+	ret = -1;
+      }
+      goto done;
+    }
+#endif
     if (!io->in_write)  /* Need to prepare new iov? */
-      hi_make_iov(io);
-    if (!io->in_write)
+      hi_make_iov(hit, io);
+    if (!io->in_write) {
+#ifdef TCP_CORK
+      if (io->corked)
+	hi_uncork(io);
+#endif
       return;            /* Nothing further to write */
+    }
+#ifdef HAVE_IO_URING
+    if (io->shf->ur) {
+      if (!(io->fd & 0x80000000))  /* closed meanwhile by reader */
+	hi_ur_writev(io);
+      return;
+    }
+#endif
   retry:
-    D("writev(%x) n_iov=%d", io->fd, io->n_iov);
-    ret = writev(io->fd, io->iov_cur, io->n_iov);
+#ifdef MSG_MORE
+    if ((io->to_write_consume || io->to_write_in) && !(io->qel.flags & HI_F_NOSOCK)) {
+      D("sendmsg(%x) n_iov=%d MSG_MORE", io->fd, io->n_iov);
+      msg.msg_iov = io->iov_cur;
+      msg.msg_iovlen = io->n_iov;
+      ret = sendmsg(io->fd, &msg, MSG_MORE);
+      if (ret == -1 && errno == ENOTSOCK) {
+	io->qel.flags |= HI_F_NOSOCK;
+	goto retry;
+      }
+      io->corked = 1;
+    } else
+#endif
+    {
+      D("writev(%x) n_iov=%d", io->fd, io->n_iov);
+      ret = writev(io->fd, io->iov_cur, io->n_iov);
+      io->corked = 0;
+    }
+  done:
     switch (ret) {
     case 0: NEVERNEVER("writev on %x returned 0", io->fd);
     case -1:
@@ -273,7 +621,6 @@ void hi_write(struct hi_thr* hit, struct hi_io* io)
       case EAGAIN: return;  /* writev(2) exhausted (c.f. edge triggered epoll) */
       default:
 	ERR("writev(%x) failed: %d %s (closing connection)", io->fd, errno, STRERROR(errno));
-	UNLOCK(io->qel.mut, "closefd");
 	hi_close(hit, io);
 	return;
       }
@@ -284,4 +631,43 @@ void hi_write(struct hi_thr* hit, struct hi_io* io)
   }
 }
 
+/* Only one thread at a time writes an io: the todo queue may hand the io to
+ * another thread while the first one is still in hi_in_out(), and hi_flush()
+ * writes ios of the shard regardless. A thread that finds the io being written
+ * leaves the writing to the owner, who goes another round before letting go. */
+
+void hi_write(struct hi_thr* hit, struct hi_io* io)
+{
+  if (!__sync_bool_compare_and_swap(&io->writing, 0, hit)) {
+    io->write_again = 1;
+    __sync_synchronize();
+    if (!__sync_bool_compare_and_swap(&io->writing, 0, hit))
+      return;  /* owner will see write_again */
+  }
+  do {
+    io->write_again = 0;
+    hi_write0(hit, io);
+    __sync_lock_release(&io->writing);
+    __sync_synchronize();
+  } while (io->write_again && !(io->fd & 0x80000000) && !io->closing
+	   && __sync_bool_compare_and_swap(&io->writing, 0, hit));
+}
+
+/* Write to the ios that were sent to during the todo item just processed, see
+ * hi_send0(). A DTS link that drained gets to pull more D_PDUs from its
+ * scheduler, which brings it back here until the link is full or idle. */
+
+void hi_flush(struct hi_thr* hit)
+{
+  struct hi_io* io;
+  while (hit->n_flush) {
+    io = hit->flush[--hit->n_flush];
+    if (io->fd & 0x80000000)
+      continue;  /* closed meanwhile */
+    hi_write(hit, io);
+    if (io->qel.proto == S5066_DTS && !(io->fd & 0x80000000) && !io->in_write)
+      dts_sched_kick(hit, io);
+  }
+}
+
 /* EOF  --  hiwrite.c */
@@ -16,7 +16,7 @@
 
 struct hi_pdu* http_encode_start(struct hi_thr* hit)
 {
-  struct hi_pdu* resp = hi_pdu_alloc(hit);
+  struct hi_pdu* resp = hi_pdu_alloc(hit, HI_PDU_MEM);
   if (!resp) { NEVERNEVER("*** out of pdus in bad place %d", 0); }
   return resp;
 }
@@ -51,7 +51,7 @@ int http_decode(struct hi_thr* hit, struct hi_io* io)
   int n = req->ap - p;
   
   if (n < HTTP_MIN_PDU_SIZE) {   /* too little, need more */
-    req->need = HTTP_MIN_PDU_SIZE - n;
+    req->need = HTTP_MIN_PDU_SIZE;
     return 0;
   }
   
@@ -0,0 +1,351 @@
+/* route.c  -  Routing of C_PDUs to DTS links by destination node address
+ * Copyright (c) 2006 Sampo Kellomaki (sampo@iki.fi), All Rights Reserved.
+ * See file COPYING.
+ *
+ * A node may front several DTS links, e.g. one per HF radio. Routes map a
+ * prefix of the 28 bit node address to one or more links. Unicast C_PDUs go
+ * to the least loaded link of the longest matching route, group C_PDUs to
+ * every link of it, and broadcast C_PDUs to every link there is. Routes are
+ * configured with -route, and host routes are learned from the source address
+ * of D_PDUs received on a link. If nothing matches, all links are candidates.
+ *
+ * Routes live in an open addressing hash table keyed by prefix and length.
+ * Longest prefix match probes only the lengths that are in use, longest first.
+ */
+
+#include "afr.h"
+#include "hiios.h"
+#include "errmac.h"
+#include "s5066.h"
+
+#include <memory.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DTS_ROUTE_SLOTS 1024   /* power of two, at most half full */
+
+struct dts_route {
+  unsigned int key;      /* DTS_ADDR_GROUP flag and address, masked to plen */
+  signed char plen;      /* prefix length in bits, -1 if slot is free */
+  char learned;          /* host route learned from received D_PDU, see dts_route_learn() */
+  char n_links;
+  unsigned char rr;      /* round robin among equally loaded links */
+  struct hi_io* links[DTS_ROUTE_MAX_LINKS];
+};
+
+static struct dts_route dts_routes[DTS_ROUTE_SLOTS];
+static int dts_n_routes;
+static struct hi_io** dts_links;  /* every live DTS link, see dts_link_add() */
+static int dts_n_links;
+static int dts_max_links;
+static unsigned int dts_plens;  /* bit n set if some route has prefix length n */
+static unsigned char dts_rr;    /* round robin when no route matches */
+pthread_mutex_t dts_route_mut = MUTEX_INITIALIZER;
+
+#define DTS_ADDR_MASK(plen) ((plen) ? (DTS_ADDR_ALL << (DTS_ADDR_BITS - (plen))) & DTS_ADDR_ALL : 0)
+
+/* Canonical form of 4 byte SIS address: group flag and 28 bit address. The
+ * size field counts the significant nibbles, which are stored first, so the
+ * same address may be seen with different sizes, e.g. 0x61230000 and 0xe0000123
+ * as D_PDU encoding pads the shorter of the two addresses with leading zeroes,
+ * see dts_enc_two_addr(). */
+
+unsigned int dts_addr_key(char* addr)
+{
+  int size = (addr[0] >> 5) & 0x07;
+  unsigned int a = (addr[0] & 0x0f) << 24 | (addr[1] & 0xff) << 16 | (addr[2] & 0xff) << 8 | addr[3] & 0xff;
+  if (!size)
+    size = 7;
+  a >>= 4 * (7 - size);
+  return addr[0] & 0x10 ? DTS_ADDR_GROUP | a : a;
+}
+
+/* Parse [*]A.B.C.D, A being 0-15, into 4 byte SIS address of minimal size.
+ * Leading * marks a group address. Returns length of text parsed, or 0 on error. */
+
+int dts_parse_addr(char* s, char* addr)
+{
+  int a, b, c, d, n = 0, size, group = 0;
+  unsigned int key;
+  if (*s == '*') {
+    group = 1;
+    ++s;
+  }
+  if (sscanf(s, "%d.%d.%d.%d%n", &a, &b, &c, &d, &n) != 4 || n == 0
+      || a < 0 || a > 15 || b < 0 || b > 255 || c < 0 || c > 255 || d < 0 || d > 255)
+    return 0;
+  key = a << 24 | b << 16 | c << 8 | d;
+  for (size = 1; size < 7 && key >> 4 * size; ++size) ;
+  key <<= 4 * (7 - size);  /* significant nibbles first */
+  addr[0] = size << 5 | group << 4 | (key >> 24) & 0x0f;
+  addr[1] = key >> 16;
+  addr[2] = key >> 8;
+  addr[3] = key;
+  return n + group;
+}
+
+static int dts_route_hash(unsigned int key, int plen)
+{
+  key = (key ^ plen) * 0x9e3779b1;
+  return (key >> 16) & (DTS_ROUTE_SLOTS - 1);
+}
+
+/* Find slot of exact route, or the free slot where it would go. Caller holds dts_route_mut. */
+
+static struct dts_route* dts_route_slot(unsigned int key, int plen)
+{
+  int i = dts_route_hash(key, plen);
+  for (;; i = (i + 1) & (DTS_ROUTE_SLOTS - 1))
+    if (dts_routes[i].plen == -1 || dts_routes[i].plen == plen && dts_routes[i].key == key)
+      return &dts_routes[i];
+}
+
+void dts_route_init()
+{
+  int i;
+  for (i = 0; i < DTS_ROUTE_SLOTS; ++i)
+    dts_routes[i].plen = -1;
+}
+
+/* Add route for key/plen via link. Returns the route, or 0 if table is full. */
+
+static struct dts_route* dts_route_add(unsigned int key, int plen, struct hi_io* link, int learned)
+{
+  struct dts_route* rt;
+  int i;
+  key &= DTS_ADDR_GROUP | DTS_ADDR_MASK(plen);
+  rt = dts_route_slot(key, plen);
+  if (rt->plen == -1) {
+    if (dts_n_routes >= DTS_ROUTE_SLOTS / 2) {
+      ERR("Routing table full (%d routes)", dts_n_routes);
+      return 0;
+    }
+    ++dts_n_routes;
+    rt->key = key;
+    rt->plen = plen;
+    rt->learned = learned;
+    rt->n_links = 0;
+    dts_plens |= 1 << plen;
+  }
+  for (i = 0; i < rt->n_links; ++i)
+    if (rt->links[i] == link)
+      return rt;
+  if (rt->n_links >= DTS_ROUTE_MAX_LINKS) {
+    ERR("Route 0x%07x/%d already has %d links", key & DTS_ADDR_ALL, plen, rt->n_links);
+    return rt;
+  }
+  rt->links[rt->n_links++] = link;
+  return rt;
+}
+
+/* Configure route from -route spec [*]A.B.C.D[/BITS]=N[,N...], where N is index of
+ * DTS remote on command line, counting from 0. Returns 0 on error. */
+
+int dts_route_config(char* spec, struct hi_io** links, int n_links)
+{
+  char addr[4];
+  char* p = spec;
+  int n, plen = DTS_ADDR_BITS, link;
+  unsigned int key;
+
+  if (!(n = dts_parse_addr(p, addr)))
+    goto bad;
+  p += n;
+  if (*p == '/') {
+    plen = strtol(p + 1, &p, 10);
+    if (plen < 0 || plen > DTS_ADDR_BITS)
+      goto bad;
+  }
+  if (*p != '=')
+    goto bad;
+  key = dts_addr_key(addr);
+  do {
+    link = strtol(p + 1, &p, 10);
+    if (link < 0 || link >= n_links) {
+      ERR("-route %s: there is no DTS remote %d, only %d", spec, link, n_links);
+      return 0;
+    }
+    LOCK(dts_route_mut, "route cfg");
+    dts_route_add(key, plen, links[link], 0);
+    UNLOCK(dts_route_mut, "route cfg");
+  } while (*p == ',');
+  if (*p)
+    goto bad;
+  D("route(%s) key(0x%08x/%d)", spec, key, plen);
+  return 1;
+ bad:
+  ERR("Bad -route spec(%s). Should be like 1.69.0.0/12=0,1", spec);
+  return 0;
+}
+
+/* Learn host route to remote station whose D_PDU arrived on link. Configured
+ * routes are left alone. A station that moved to another link is moved. */
+
+void dts_route_learn(struct hi_io* link, char* addr)
+{
+  struct dts_route* rt;
+  unsigned int key = dts_addr_key(addr) & DTS_ADDR_ALL;  /* source is never a group */
+  LOCK(dts_route_mut, "route learn");
+  rt = dts_route_slot(key, DTS_ADDR_BITS);
+  if (rt->plen == -1 || rt->learned) {
+    if (rt->plen != -1)
+      rt->n_links = 0;
+    if ((rt = dts_route_add(key, DTS_ADDR_BITS, link, 1)))
+      rt->learned = 1;
+    D("learned route to 0x%07x via fd(%x)", key, link->fd);
+  }
+  UNLOCK(dts_route_mut, "route learn");
+}
+
+/* Free slot rt. Entries that probed past it are moved back so that lookups
+ * need no tombstones. Caller holds dts_route_mut. */
+
+static void dts_route_del(struct dts_route* rt)
+{
+  int i = rt - dts_routes, j, home;
+  --dts_n_routes;
+  for (j = (i + 1) & (DTS_ROUTE_SLOTS - 1); dts_routes[j].plen != -1; j = (j + 1) & (DTS_ROUTE_SLOTS - 1)) {
+    home = dts_route_hash(dts_routes[j].key, dts_routes[j].plen);
+    if (((j - home) & (DTS_ROUTE_SLOTS - 1)) >= ((j - i) & (DTS_ROUTE_SLOTS - 1))) {
+      dts_routes[i] = dts_routes[j];
+      i = j;
+    }
+  }
+  dts_routes[i].plen = -1;
+}
+
+/* Register a DTS link once it is connected or accepted, and its dts_conn set
+ * up. Broadcasts, and C_PDUs that no route matches, go to registered links. */
+
+void dts_link_add(struct hi_io* link)
+{
+  LOCK(dts_route_mut, "link add");
+  if (dts_n_links == dts_max_links) {
+    dts_max_links = dts_max_links ? 2 * dts_max_links : DTS_ROUTE_MAX_LINKS;
+    REALLOCN(dts_links, dts_max_links * sizeof(struct hi_io*));
+  }
+  dts_links[dts_n_links++] = link;
+  UNLOCK(dts_route_mut, "link add");
+}
+
+/* Take closed link out of the registry and every route, see dts_close_conn().
+ * Learned routes that are left without links go away. A configured one stays,
+ * so lookups fall back to shorter prefixes, or to all links, as when its links
+ * are down. */
+
+void dts_route_drop(struct hi_io* link)
+{
+  struct dts_route* rt;
+  int i;
+  LOCK(dts_route_mut, "route drop");
+  for (i = 0; i < dts_n_links; ++i)
+    if (dts_links[i] == link) {
+      dts_links[i] = dts_links[--dts_n_links];
+      break;
+    }
+  for (rt = dts_routes; rt < dts_routes + DTS_ROUTE_SLOTS; ) {
+    if (rt->plen == -1) {
+      ++rt;
+      continue;
+    }
+    for (i = 0; i < rt->n_links; ++i)
+      if (rt->links[i] == link) {
+	rt->links[i] = rt->links[--rt->n_links];
+	break;
+      }
+    if (!rt->n_links && rt->learned) {
+      D("dropped route to 0x%07x/%d with fd(%x)", rt->key & DTS_ADDR_ALL, rt->plen, link->fd);
+      dts_route_del(rt);
+      continue;  /* some other route may have moved to rt */
+    }
+    ++rt;
+  }
+  UNLOCK(dts_route_mut, "route drop");
+}
+
+static int dts_link_ok(struct hi_io* io)
+{
+  /* not closed, nor its slot reused for other protocol */
+  return io->qel.proto == S5066_DTS && io->ad.dts && !(io->fd & 0x80000000);
+}
+
+static int dts_link_load(struct hi_io* io)
+{
+  return io->n_to_write + io->ad.dts->n_tx_pend;
+}
+
+/* Pick least loaded live link among n candidates, starting round robin at rr. */
+
+static struct hi_io* dts_link_pick(struct hi_io** links, int n, unsigned char* rr)
+{
+  struct hi_io* best = 0;
+  int i, load, best_load = 0, start = (*rr)++;
+  for (i = 0; i < n; ++i) {
+    struct hi_io* io = links[(start + i) % n];
+    if (!dts_link_ok(io))
+      continue;
+    load = dts_link_load(io);
+    if (!best || load < best_load) {
+      best = io;
+      best_load = load;
+    }
+  }
+  return best;
+}
+
+/* Collect registered DTS links into out, at most DTS_ROUTE_MAX_LINKS.
+ * Caller holds dts_route_mut. */
+
+static int dts_all_links(struct hi_io** out)
+{
+  int i, n = 0;
+  for (i = 0; i < dts_n_links && n < DTS_ROUTE_MAX_LINKS; ++i)
+    if (dts_link_ok(dts_links[i]))
+      out[n++] = dts_links[i];
+  return n;
+}
+
+/* Determine links on which to send C_PDU destined to SIS address addr. Unicast
+ * yields one link, group and broadcast possibly several. Returns number of
+ * links placed in out, which must have room for DTS_ROUTE_MAX_LINKS. */
+
+int dts_route(char* addr, struct hi_io** out)
+{
+  struct dts_route* rt;
+  unsigned int key = dts_addr_key(addr);
+  int i, plen, n = 0;
+
+  LOCK(dts_route_mut, "route");
+  if ((key & DTS_ADDR_ALL) == DTS_ADDR_ALL) {  /* broadcast */
+    n = dts_all_links(out);
+    UNLOCK(dts_route_mut, "route bcast");
+    return n;
+  }
+  for (plen = DTS_ADDR_BITS; plen >= 0; --plen) {
+    if (!(dts_plens & (1 << plen)))
+      continue;
+    rt = dts_route_slot(key & (DTS_ADDR_GROUP | DTS_ADDR_MASK(plen)), plen);
+    if (rt->plen == -1)
+      continue;
+    if (key & DTS_ADDR_GROUP) {
+      for (i = 0; i < rt->n_links; ++i)
+	if (dts_link_ok(rt->links[i]))
+	  out[n++] = rt->links[i];
+    } else if ((out[0] = dts_link_pick(rt->links, rt->n_links, &rt->rr)))
+      n = 1;
+    if (n)
+      break;  /* else all links of the route are down, try a shorter prefix */
+  }
+  
+  /* No route: group goes everywhere, unicast to least loaded of all links */
+  if (!n) {
+    if (key & DTS_ADDR_GROUP)
+      n = dts_all_links(out);
+    else if ((out[0] = dts_link_pick(dts_links, dts_n_links, &dts_rr)))
+      n = 1;
+  }
+  UNLOCK(dts_route_mut, "route");
+  return n;
+}
+
+/* EOF  --  route.c */
@@ -13,6 +13,7 @@ struct hi_io;
 struct hi_pdu;
 
 #include <pthread.h>
+#include <time.h>
 
 #define S5066_SIS  1
 #define S5066_DTS  2
@@ -45,6 +46,49 @@ struct hi_pdu;
 #define SIS_MAX_PDU_SIZE (SIS_MIN_PDU_SIZE + SIS_UNIHDR_SIZE + SIS_BCAST_MTU)
 
 #define DTS_SEG_SIZE 800  /* arbitrarily tunable below 1k (10 bits, see C.3.2.10, p. C-14) */
+#define DTS_MAX_C_PDU (SIS_BCAST_MTU + 6)  /* U_PDU plus C_PCI and S_PDU header with TTD */
+#define DTS_MAX_SEGS ((DTS_MAX_C_PDU + DTS_SEG_SIZE - 1) / DTS_SEG_SIZE)
+
+/* ARQ tuning, see dts_sched_send() and dts_arq_rx() */
+#define DTS_ARQ_WIN 128         /* Max unacked D_PDUs, half of the 8 bit sequence space */
+#define DTS_ARQ_ACK_EVERY 8     /* Receiver acks at least every this many D_PDUs */
+#define DTS_ARQ_RTO 3           /* Seconds without ACK before unacked D_PDUs are resent */
+
+/* NONARQ reassembly, see dts_nonarq_rx() */
+#define DTS_NONARQ_SLOTS 64     /* Hash table size per channel, power of two */
+#define DTS_NONARQ_MAX (DTS_NONARQ_SLOTS/2)  /* C_PDUs reassembled at a time, oldest is dropped */
+#define DTS_NONARQ_TTL 120      /* Seconds to wait for missing segments, see -nonarqttl */
+
+/* Transmit scheduler, see dts_sched_pull() */
+#define DTS_N_PRIO 16           /* SIS priorities 0-15, 15 is most urgent */
+#define DTS_CLASS_EXPEDITED DTS_N_PRIO  /* served before any priority */
+#define DTS_N_CLASS (DTS_N_PRIO + 1)
+#define DTS_SCHED_DEPTH 2       /* D_PDUs handed to the write queue ahead of time */
+#define DTS_SCHED_QUANTUM DTS_SEG_SIZE  /* DRR credit per round, bytes */
+#define DTS_PEND_HI 512         /* D_PDUs queued on link: send S_DATA_FLOW_OFF */
+#define DTS_PEND_LO 128         /* ... and S_DATA_FLOW_ON once drained below this */
+
+/* Flags of DATA-ONLY and DATA-ACK D_PDUs, see C.3.3, p. C-16 */
+#define DTS_F_START   0x80      /* C_PDU START */
+#define DTS_F_END     0x40      /* C_PDU END */
+#define DTS_F_INORDER 0x20      /* Deliver in order */
+#define DTS_F_DROP    0x10      /* Drop PDU */
+#define DTS_F_UWE     0x08      /* TX window upper edge */
+#define DTS_F_LWE     0x04      /* TX window lower edge */
+
+/* Room for the longest D_PDU header (DATA-ACK with full window bitmap and 7 byte
+ * address) and its CRC. The data CRC of a segment is kept at this offset so the
+ * header can grow in front of it, see dts_late_bind(). */
+#define DTS_HDR_ROOM (2 + 31 + 7 + 2)
+#define DTS_BPS 2400            /* Default modem data rate for EOT and reception window */
+#define DTS_PACE_LEAD 200000    /* usec of data left in modem when paced link releases next D_PDU */
+#define DTS_TX_USEC(bytes, bps) ((long long)(bytes) * 8000000 / (bps))  /* time on the air */
+
+/* Node addresses, see route.c */
+#define DTS_ADDR_BITS  28
+#define DTS_ADDR_ALL   0x0fffffff  /* also the broadcast address */
+#define DTS_ADDR_GROUP 0x10000000  /* group flag, as in canonical form of dts_addr_key() */
+#define DTS_ROUTE_MAX_LINKS 16     /* links per route, e.g. HF radios fronted by one node */
 
 /* N.B. In practise segment size is limited by 8 bit EOT (End Of Transmission) field
  * that has range of 127.5 seconds. Given slow data rate, a PDU can take long time
@@ -93,23 +137,61 @@ int dts_decode(struct hi_thr* hit, struct hi_io* io);
 int smtp_decode_req(struct hi_thr* hit, struct hi_io* io);
 int smtp_decode_resp(struct hi_thr* hit, struct hi_io* io);
 int http_decode(struct hi_thr* hit, struct hi_io* io);
-void dts_send_uni(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int len, char* d);
+void dts_send_uni(struct hi_thr* hit, struct hi_pdu* req, int len, char* d, int expedited);
+struct dts_conn* dts_new_conn();
+void dts_close_conn(struct hi_thr* hit, struct hi_io* io);
+int dts_late_bind(struct hi_io* io, struct hi_pdu* pdu, int remaining);
+void dts_sched_kick(struct hi_thr* hit, struct hi_io* io);
+void dts_route_init();
+int dts_route_config(char* spec, struct hi_io** links, int n_links);
+void dts_route_learn(struct hi_io* link, char* addr);
+void dts_link_add(struct hi_io* link);
+void dts_route_drop(struct hi_io* link);
+int dts_route(char* addr, struct hi_io** out);
+int dts_parse_addr(char* s, char* addr);
+unsigned int dts_addr_key(char* addr);
+extern char my_station_addr[4];
+extern int dts_bps;
+extern char dts_pace;
+extern int dts_nonarq_ttl;
+void crc_s5066_init();
+unsigned short CRC_16_S5066(unsigned char DATA, unsigned short CRC);
+unsigned int CRC_32_S5066(unsigned char DATA, unsigned int CRC);
+unsigned short CRC_16_S5066_upd(unsigned short CRC, char* p, char* lim);
+unsigned int CRC_32_S5066_upd(unsigned int CRC, char* p, char* lim);
+unsigned short CRC_16_S5066_batch(char* p, char* lim);
+unsigned int CRC_32_S5066_batch(char* p, char* lim);
+unsigned int CRC_32_S5066_copy(char* d, char* p, char* lim);
 void sis_send_bind(struct hi_thr* hit, struct hi_io* io, int sap, int rank, int svc_type);
-struct hi_pdu* sis_encode_start(struct hi_thr* hit, int op, int len);
+void sis_send_flow(struct hi_thr* hit, int sap, int on);
+struct hi_pdu* sis_encode_start(struct hi_thr* hit, int op, int len, int hdr_len);
 
 struct u_pdu {
   short len;
   char* data;
 };
 
-struct sis_sap {
-  struct hi_io* io;
+#define SIS_MAX_SAP_CLIENTS 4  /* clients that may bind the same SAP, see sis_bind() */
+
+struct sis_client {      /* bound SIS client, the io points back with ad.sis.cl */
+  struct hi_io* io;      /* 0 if entry is free */
   char rank;
   char tx_mode;
   char flags;
   char n_re_tx;
 };
 
+/* Only bind, unbind, and close change saptab, under saptab_mut. Delivery to
+ * the SAP just loads io, which they republish, so DTS never waits for the lock.
+ * io slots are never freed, so a client that is going away may get a last
+ * PDU, much as if the PDU had arrived just before the unbind. */
+
+struct sis_sap {
+  struct hi_io* io;      /* client of highest rank, gets the indications, see sis_sap_elect() */
+  int n_flow_off;        /* DTS links congested by the SAP, FLOW_OFF while not 0, see sis_send_flow() */
+  struct sis_client cl[SIS_MAX_SAP_CLIENTS];
+};
+
 #define SIS_MAX_SAP_ID 16
 extern struct sis_sap saptab[SIS_MAX_SAP_ID];
 extern pthread_mutex_t saptab_mut;
@@ -120,18 +202,74 @@ struct c_pdu_buf {
   char m[SIS_MAX_PDU_SIZE];
 };
 
-struct dts_conn {
-  char remote_station_addr[4];
+struct dts_reasm {       /* NONARQ C_PDU being reassembled, see dts_nonarq_slot() */
+  short c_pdu_id;        /* 12 bits, -1 if slot is free */
+  time_t expire;         /* first segment arrived plus dts_nonarq_ttl */
+  struct hi_pdu* pdu;    /* 0 once delivered: repeats are dropped until expire */
+};
+
+struct dts_flow {        /* C_PDUs of one SAP in one class, see dts_sched_next() */
+  struct hi_pdu* head;   /* C_PDU handles, chained by n */
+  struct hi_pdu* tail;
+  struct dts_flow* next; /* ring of active flows of the class */
+  int deficit;           /* DRR: bytes the flow may still send this round */
+};
+
+/* ARQ and reassembly state of one data channel. Normal and expedited data each
+ * have their own, so expedited D_PDUs (EDATA-ONLY, EACK-ONLY, ENONARQ) have
+ * their own TX and RX windows and never wait behind normal data (C.3.5). */
+
+#define DTS_CH_NORMAL    0
+#define DTS_CH_EXPEDITED 1
+#define DTS_N_CH         2
+
+struct dts_chan {
+  char expedited;
   int c_pdu_id;
-  int rx_lwe;
-  int rx_uwe;
-  char acks[32];  /* Bitmap of acks, kept on receiving end */
-  /* *** Do we need "memory ACK" array for misreceived PDUs? */
-  struct hi_pdu* nonarq_pdus[4096];  /* The c_pdu_id is 12 bits */
+  int rx_lwe;           /* Oldest D_PDU not yet received, all before it have been */
+  struct hi_pdu* rx_pdus[256];  /* Received out of order, wait for gap before rx_lwe to fill */
+  struct hi_pdu* rx_c_pdu;      /* C_PDU being reassembled from in order D_PDUs */
+  struct dts_reasm nonarq[DTS_NONARQ_SLOTS];  /* open addressing by c_pdu_id */
+  int n_nonarq;
   
-  int tx_lwe;
-  int tx_uwe;
+  int tx_lwe;           /* Oldest unacked D_PDU */
+  int tx_nxt;           /* Next TX frame sequence number to assign */
+  int tx_sack_hi;       /* Highest D_PDU selectively acked, gaps below it were resent */
+  time_t tx_time;       /* Last time the window moved or was resent, see dts_arq_timeout() */
   struct hi_pdu* tx_pdus[256];  /* Hold PDUs so we can re_tx them if they are not ack'd */
+  int n_arq_pend;       /* ARQ D_PDUs queued in flows, see DTS_F_UWE */
+  struct hi_pdu* tx_arq_cur;    /* ARQ C_PDU being segmented, others wait until it ends */
+  
+  /* Snapshot of rx state that the next D_PDU written will carry, see dts_late_bind().
+   * Protected by dts->ack_mut. */
+  char ack[1 + DTS_ARQ_WIN/8];  /* rx_lwe followed by bitmap of D_PDUs held beyond it */
+  int ack_len;          /* bytes of bitmap */
+  int ack_due;          /* D_PDUs received since an ACK last went out */
+  char ack_queued;      /* ACK-ONLY is in to_write, not yet bound */
+};
+
+struct dts_conn {
+  pthread_mutex_t mut;  /* protects ARQ and scheduler state, see dts_sched_pull() and dts_arq_rx() */
+  char remote_station_addr[4];  /* learned from received D_PDUs, see dts_decode() */
+  struct dts_chan ch[DTS_N_CH];
+  
+  struct dts_flow flows[DTS_N_CLASS][SIS_MAX_SAP_ID];
+  struct dts_flow* active[DTS_N_CLASS];  /* last of ring of flows with C_PDUs, next is served */
+  int class_mask;       /* bit set for classes that have active flows */
+  int n_tx_pend;        /* D_PDUs queued in flows, including NONARQ repeats */
+  int flow_off;         /* bit set for SAPs this link counts in n_flow_off of saptab */
+  int bps;              /* modem data rate, see -bps and serial_init() */
+  char paced;           /* release D_PDUs only as fast as the modem sends them, see dts_pace_hold() */
+  time_t nonarq_exp;    /* soonest expire in nonarq tables, 0 if none, see dts_nonarq_expire() */
+  
+  /* Receive errors, see dts_decode(). Only the reader touches these. */
+  int n_junk;           /* bytes discarded hunting for preamble */
+  int n_hdr_crc_err;    /* header CRC failures, each followed by a hunt */
+  int n_crc_err;        /* data CRC failures, the D_PDU is dropped */
+  
+  /* ack_mut is a leaf lock, taken by the writer, see dts_late_bind() */
+  pthread_mutex_t ack_mut;
+  long long tx_clear;   /* when modem will have sent all D_PDUs written so far, usec */
 };
 
 /* SMTP support */
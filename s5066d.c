@@ -19,6 +19,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 
 #ifdef HAVE_NET_SNMP
 #include "snmpInterface.h"
@@ -68,9 +69,17 @@ Usage: s5066d [options] PROTO:REMOTEHOST:PORT\n\
   -c  CIPHER       Enable crypto on DTS interface using specified cipher. Use '?' for list.\n\
   -k  FDNUMBER     File descriptor for reading symmetric key. Use 0 for stdin.\n\
   -nfd  NUMBER     Maximum number of file descriptors, i.e. simultaneous\n\
-                   connections. Default 20 (about 16 connections).\n\
-  -npdu NUMBER     Maximum number of simultaneously active PDUs. Default 60.\n\
+                   connections. Default is the process limit (ulimit -n).\n\
+                   Connections beyond this are refused.\n\
+  -npdu NUMBER     Maximum number of simultaneously active PDUs. Default 10000.\n\
+                   Each thread may hold up to 16 free PDUs in its cache.\n\
+                   When reached, reading from network pauses until PDUs free up.\n\
+                   Both tables grow on demand, up to these ceilings.\n\
   -nthr NUMBER     Number of threads. Default 1. Should not exceed number of CPUs.\n\
+  -shard           Give every thread its own poll set and todo queue. Listeners\n\
+                   are replicated per thread using SO_REUSEPORT (Linux 3.9+).\n\
+  -uring           Use io_uring instead of epoll (Linux 5.13+). Writes of a batch\n\
+                   of work are submitted with one system call.\n\
   -nkbuf BYTES     Size of kernel buffers. Default is not to change kernel buffer size.\n\
   -nlisten NUMBER  Listen backlog size. Default 128.\n\
   -egd PATH        Specify path of Entropy Gathering Daemon socket, default on\n\
@@ -80,6 +89,20 @@ Usage: s5066d [options] PROTO:REMOTEHOST:PORT\n\
   -rand PATH       Location of random number seed file. On Solaris EGD is used.\n\
                    On Linux the default is /dev/urandom. See RFC1750.\n\
   -snmp PORT       Enable SNMP agent (if compiled with Net SNMP).\n\
+  -me ADDR         Our STANAG 5066 node address. Default 1.35.69.103.\n\
+  -hmtp ADDR       Node address of the remote HMTP peer for mail relayed from SMTP.\n\
+  -bps BPS         Modem data rate in bits per second, default 2400. Sets EOT and\n\
+                   reception window, and paces DTS links: D_PDUs are released\n\
+                   only as fast as the modem can send them. Without this, TCP\n\
+                   links are not paced and serial links are paced at line rate.\n\
+  -nonarqttl SECS  Drop a non-ARQ C_PDU that is still missing segments this long\n\
+                   after its first segment arrived. Default 120.\n\
+  -route SPEC      Route node addresses to DTS remotes, e.g. 1.69.0.0/12=0,1 sends\n\
+                   to least loaded of the first two DTS remotes on command line.\n\
+                   Leading * in ADDR makes it a group address, sent on all links\n\
+                   of the route. May be repeated. Routes to remote stations are\n\
+                   also learned from received D_PDUs. Unrouted traffic goes to\n\
+                   the least loaded DTS link.\n\
   -uid UID:GID     If run as root, drop privileges and assume specified uid and gid.\n\
   -pid PATH        Write process id in the supplied path\n\
   -watchdog        Enable built-in watch dog\n\
@@ -99,9 +122,11 @@ int verbose = 1;
 int debug = 0;
 int debugpoll = 0;
 int timeout = 0;
-int nfd = 20;
-int npdu = 60;
+int nfd = 0;       /* 0 = use RLIMIT_NOFILE */
+int npdu = 10000;
 int nthr = 1;
+int shard = 0;
+int uring = 0;     /* io_uring(7) instead of epoll, see hiios.c */
 int nkbuf = 0;
 int listen_backlog = 128;   /* what is right tuning for this? */
 int gcthreshold = 0;
@@ -130,8 +155,12 @@ struct hi_proto prototab[] = {
   { "", 0 }
 };
 
-char remote_station_addr[] = { 0x61, 0x89, 0x00, 0x00 };   /* *** temp kludge */
+char remote_station_addr[] = { 0x61, 0x89, 0x00, 0x00 };   /* HMTP peer, see -hmtp */
+#define MAX_ROUTE_SPECS 64
+char* route_specs[MAX_ROUTE_SPECS];
+int n_route_specs = 0;
 struct hiios* shuff;        /* Main I/O shuffler object */
+struct hiios** shards;      /* With -shard, one shuffler per thread. shards[0] == shuff */
 
 #define SNMPLOGFILE "/var/tmp/snmpOpen5066.log"
 
@@ -245,6 +274,11 @@ void opt(int* argc, char*** argv, char*** env)
 	if (!(*argc)) break;
 	listen_backlog = atoi((*argv)[0]);
 	continue;
+      case 'o': if (strcmp((*argv)[0],"-nonarqttl")) break;
+	++(*argv); --(*argc);
+	if (!(*argc)) break;
+	if ((dts_nonarq_ttl = atoi((*argv)[0])) <= 0) break;
+	continue;
       }
       break;
 
@@ -255,6 +289,12 @@ void opt(int* argc, char*** argv, char*** env)
 	if (!(*argc)) break;
 	snmp_port = atoi((*argv)[0]);
 	continue;
+      case 'h':
+	if (!strcmp((*argv)[0],"-shard")) {
+	  ++shard;
+	  continue;
+	}
+	break;
       }
       break;
 
@@ -355,6 +395,14 @@ void opt(int* argc, char*** argv, char*** env)
 	  continue;
 	}
 	break;
+      case 'o':
+	if (!strcmp((*argv)[0],"-route")) {
+	  ++(*argv); --(*argc);
+	  if (!(*argc) || n_route_specs >= MAX_ROUTE_SPECS) break;
+	  route_specs[n_route_specs++] = (*argv)[0];
+	  continue;
+	}
+	break;
       }
       break;
 
@@ -421,9 +469,38 @@ void opt(int* argc, char*** argv, char*** env)
 	if (!(*argc)) break;
 	sscanf((*argv)[0], "%i:%i", &drop_uid, &drop_gid);
 	continue;
+      case 'r': if (strcmp((*argv)[0],"-uring")) break;
+#ifdef HAVE_IO_URING
+	++uring;
+#else
+	ERR("This binary was not compiled to support io_uring. Continuing with %s.", "poll");
+#endif
+	continue;
       }
       break;
 
+    case 'm':
+      if (strcmp((*argv)[0],"-me")) break;
+      ++(*argv); --(*argc);
+      if (!(*argc)) break;
+      if (!dts_parse_addr((*argv)[0], my_station_addr)) break;
+      continue;
+
+    case 'h':
+      if (strcmp((*argv)[0],"-hmtp")) break;
+      ++(*argv); --(*argc);
+      if (!(*argc)) break;
+      if (!dts_parse_addr((*argv)[0], remote_station_addr)) break;
+      continue;
+
+    case 'b':
+      if (strcmp((*argv)[0],"-bps")) break;
+      ++(*argv); --(*argc);
+      if (!(*argc)) break;
+      if ((dts_bps = atoi((*argv)[0])) <= 0) break;
+      dts_pace = 1;
+      continue;
+
     case 'l':
       switch ((*argv)[0][2]) {
       case 'i':
@@ -451,14 +528,25 @@ void opt(int* argc, char*** argv, char*** env)
     ++(*argv); --(*argc);
   }
   
-  if (nfd < 1)  nfd = 1;
-  if (npdu < 1) npdu = 1;
   if (nthr < 1) nthr = 1;
+  if (nfd < 1) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 1<<20)
+      nfd = 1<<20;
+    else
+      nfd = rl.rlim_cur;
+  }
+  /* Free PDUs sitting in thread caches must not be able to exhaust the ceiling. */
+  if (npdu < (nthr + 1) * HI_PDU_CACHE_HI)
+    npdu = (nthr + 1) * HI_PDU_CACHE_HI;
 }
 
 /* Parse serial port config string and do all the ioctls to get it right. */
 
-static struct hi_io* serial_init(struct hi_host_spec* hs)
+/* Open serial DTS link. Its line rate, net of start, parity, and stop bits
+ * in async mode, is stored in bps, see -bps. */
+
+static struct hi_io* serial_init(struct hiios* shf, struct hi_host_spec* hs, int* bps)
 {
   char tty[256];
   char sync = 'S', parity = 'N';
@@ -483,7 +571,11 @@ static struct hi_io* serial_init(struct hi_host_spec* hs)
   if (verbose)
     log_port_info(fd, tty, "after");
   nonblock(fd);
-  return hi_add_fd(shuff, fd, hs->proto, HI_TCP_C, hs->specstr);
+  if (sync == 'A')
+    *bps = baud * bits / (1 + bits + (parity != 'N') + stop);
+  else
+    *bps = baud;
+  return hi_add_fd(shf, fd, hs->proto, HI_TCP_C, hs->specstr);
 }
 
 void* thread_loop(void* _shf)
@@ -501,6 +593,7 @@ void* thread_loop(void* _shf)
 
 int main(int argc, char** argv, char** env)
 { 
+  int i, nshard;
   struct hi_thr hit;
   memset(&hit, 0, sizeof(hit));
   afr_init(*argv);
@@ -543,6 +636,7 @@ int main(int argc, char** argv, char** env)
   
   /*openlog("s5066d", LOG_PID, LOG_LOCAL0);     Do we want syslog logging? */
   opt(&argc, &argv, &env);
+  crc_s5066_init();
 
   /*if (stats_prefix) init_cmdline(argc, argv, env, stats_prefix);*/
   CMDLINE("init");
@@ -618,22 +712,36 @@ int main(int argc, char** argv, char** env)
 #endif
 
   hit.shf = shuff = hi_new_shuffler(nfd, npdu);
+  if (!shard)
+    nshard = 1;
+  else
+    nshard = nthr;
+  ZMALLOCN(shards, sizeof(struct hiios*) * nshard);
+  shards[0] = shuff;
+  for (i = 1; i < nshard; ++i)
+    shards[i] = hi_new_shard(shuff);
+  dts_route_init();
   {
     struct hi_io* io;
     struct hi_host_spec* hs;
     struct hi_host_spec* hs_next;
+    struct hi_io* dts_links[DTS_ROUTE_MAX_LINKS];
+    int n_dts_links = 0, line_bps = 0;
 
     /* Prepare listeners first so we can then later connect to ourself. */
     CMDLINE("listen");
 
     for (hs = listen_ports; hs; hs = hs->next) {
-      io = hi_open_listener(shuff, hs, hs->proto);
-      if (!io) break;
-      io->n = hs->conns;
-      hs->conns = io;
+      for (i = 0; i < nshard; ++i) {  /* with -shard, each shard listens to same port */
+	io = hi_open_listener(shards[i], hs, hs->proto);
+	if (!io) break;
+	io->n = hs->conns;
+	hs->conns = io;
+      }
     }
     
-    for (hs = remotes; hs; hs = hs_next) {
+    /* Outbound connections are spread round robin over the shards */
+    for (i = 0, hs = remotes; hs; hs = hs_next, ++i) {
       hs_next = hs->next;
       hs->next = prototab[hs->proto].specs;
       prototab[hs->proto].specs = hs;
@@ -641,9 +749,9 @@ int main(int argc, char** argv, char** env)
 	continue;  /* SMTP connections are opened later, when actual data from SIS arrives. */
 
       if (hs->sin.sin_family == 0xfead)
-	io = serial_init(hs);
+	io = serial_init(shards[i % nshard], hs, &line_bps);
       else
-	io = hi_open_tcp(shuff, hs, hs->proto);
+	io = hi_open_tcp(shards[i % nshard], hs, hs->proto);
       if (!io) break;
       io->n = hs->conns;
       hs->conns = io;
@@ -651,15 +759,28 @@ int main(int argc, char** argv, char** env)
       case S5066_SIS:   /* *** Always bind as HMTP. Make configurable. */
 	sis_send_bind(&hit, io, SAP_ID_HMTP, 0, 0x0200);  /* 0x0200 == nonarq, no repeats */
 	break;
-      case S5066_DTS:
-	ZMALLOC(io->ad.dts);
-	io->ad.dts->remote_station_addr[0] = 0x61;   /* three nibbles long (padded with zeroes) */
-	io->ad.dts->remote_station_addr[1] = 0x23;
-	io->ad.dts->remote_station_addr[2] = 0x00;
-	io->ad.dts->remote_station_addr[3] = 0x00;
+      case S5066_DTS:  /* hi_add_fd() set up its dts_conn */
+	if (hs->sin.sin_family == 0xfead && !dts_pace) {
+	  LOCK(io->ad.dts->mut, "pace serial");
+	  io->ad.dts->bps = line_bps;
+	  io->ad.dts->paced = 1;
+	  UNLOCK(io->ad.dts->mut, "pace serial");
+	}
+	if (n_dts_links < DTS_ROUTE_MAX_LINKS)
+	  dts_links[n_dts_links++] = io;
 	break;
       }
     }
+
+    /* remotes is in reverse command line order, but -route counts DTS remotes from the left */
+    for (i = 0; i < n_dts_links / 2; ++i) {
+      io = dts_links[i];
+      dts_links[i] = dts_links[n_dts_links - 1 - i];
+      dts_links[n_dts_links - 1 - i] = io;
+    }
+    for (i = 0; i < n_route_specs; ++i)
+      if (!dts_route_config(route_specs[i], dts_links, n_dts_links))
+	exit(3);
   }
 
   if (snmp_port) {
@@ -684,7 +805,7 @@ int main(int argc, char** argv, char** env)
     int err;
     pthread_t tid;
     for (--nthr; nthr; --nthr)
-      if ((err = pthread_create(&tid, 0, thread_loop, shuff))) {
+      if ((err = pthread_create(&tid, 0, thread_loop, shards[nthr % nshard]))) {
 	ERR("pthread_create() failed: %d (nthr=%d)", err, nthr);
 	exit(2);
       }
@@ -26,12 +26,15 @@ int sisconfirm_max = 100; /* Maximum amount of confirmation PDU data */
 int sislocalconfirmhack = 1; /* fakes node delivery and client delivery confirmations by
 				confirming before even sending data to DTS */
 
-struct hi_pdu* sis_encode_start(struct hi_thr* hit, int op, int len)
+/* len is the length of the whole primitive. Only hdr_len bytes of it are
+ * built in resp, the rest is sent from elsewhere, see hi_send2(). */
+
+struct hi_pdu* sis_encode_start(struct hi_thr* hit, int op, int len, int hdr_len)
 {
-  struct hi_pdu* resp = hi_pdu_alloc(hit);
+  struct hi_pdu* resp = hi_pdu_alloc(hit, hdr_len);
   if (!resp) { NEVERNEVER("*** out of pdus in bad place %d", op); }
-  resp->len = len;
-  resp->ap += len;
+  resp->len = hdr_len;
+  resp->ap += hdr_len;
   len -= 5;  /* exclude preamble and length field from primitive length */
   resp->m[0] = 0x90;
   resp->m[1] = 0xeb;
@@ -44,7 +47,7 @@ struct hi_pdu* sis_encode_start(struct hi_thr* hit, int op, int len)
 
 void sis_send_bind(struct hi_thr* hit, struct hi_io* io, int sap, int rank, int svc_type)
 {
-  struct hi_pdu* resp = sis_encode_start(hit, S_BIND_REQUEST, SPRIM_TLEN(bind_request));
+  struct hi_pdu* resp = sis_encode_start(hit, S_BIND_REQUEST, SPRIM_TLEN(bind_request), SPRIM_TLEN(bind_request));
   resp->m[6] = (sap << 4) & 0xf0 |  rank & 0x0f;
   resp->m[7] = (svc_type >> 4) & 0x00ff;
   resp->m[8] = (svc_type << 4) & 0xf0;
@@ -53,14 +56,14 @@ void sis_send_bind(struct hi_thr* hit, struct hi_io* io, int sap, int rank, int
 
 void sis_send_bind_rej(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int reason)
 {
-  struct hi_pdu* resp = sis_encode_start(hit, S_BIND_REJECTED, SPRIM_TLEN(bind_rejected));
+  struct hi_pdu* resp = sis_encode_start(hit, S_BIND_REJECTED, SPRIM_TLEN(bind_rejected), SPRIM_TLEN(bind_rejected));
   resp->m[6] = reason;
   hi_send(hit, io, req, resp);
 }
 
 void sis_send_bind_ok(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int sap, int mtu)
 {
-  struct hi_pdu* resp = sis_encode_start(hit, S_BIND_ACCEPTED, SPRIM_TLEN(bind_accepted));
+  struct hi_pdu* resp = sis_encode_start(hit, S_BIND_ACCEPTED, SPRIM_TLEN(bind_accepted), SPRIM_TLEN(bind_accepted));
   resp->m[6] = (sap << 4) & 0xf0;
   resp->m[7] = (mtu >> 8) & 0xff;
   resp->m[8] = mtu & 0xff;
@@ -69,16 +72,27 @@ void sis_send_bind_ok(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req,
 
 void sis_send_unbind_ind(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int res)
 {
-  struct hi_pdu* resp = sis_encode_start(hit, S_UNBIND_INDICATION, SPRIM_TLEN(unbind_indication));
+  struct hi_pdu* resp = sis_encode_start(hit, S_UNBIND_INDICATION, SPRIM_TLEN(unbind_indication), SPRIM_TLEN(unbind_indication));
   resp->m[6] = res;
   hi_send(hit, io, req, resp);
 }
 
+static void sis_send_flow1(struct hi_thr* hit, struct hi_io* io, int on)
+{
+  struct hi_pdu* resp = sis_encode_start(hit, on ? S_DATA_FLOW_ON : S_DATA_FLOW_OFF, SPRIM_TLEN(data_flow_on), SPRIM_TLEN(data_flow_on));
+  hi_send(hit, io, 0, resp);
+}
+
+/* Confirm S_UNIDATA_REQUEST or S_EXPEDITED_UNIDATA_REQUEST. The two
+ * requests, as well as the two confirmations, share layout. */
+
 void sis_send_uni_ok(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req)
 {
   int size = MIN(sisconfirm_max, ntohs(((struct s_hdr*)req->m)->sprim.unidata_req.size_of_pdu));
   int len  = SPRIM_TLEN(unidata_req_confirm);
-  struct hi_pdu* resp = sis_encode_start(hit, S_UNIDATA_REQUEST_CONFIRM, len + size);
+  struct hi_pdu* resp = sis_encode_start(hit, req->op == S_EXPEDITED_UNIDATA_REQUEST
+					 ? S_EXPEDITED_UNIDATA_REQUEST_CONFIRM : S_UNIDATA_REQUEST_CONFIRM,
+					 len + size, len);
   ((struct s_hdr*)resp->m)->sprim.unidata_req_confirm.not_used = 0;
   ((struct s_hdr*)resp->m)->sprim.unidata_req_confirm.dest_sap_id = ((struct s_hdr*)req->m)->sprim.unidata_req.sap_id;
   memcpy(((struct s_hdr*)resp->m)->sprim.unidata_req_confirm.dest_node,
@@ -87,16 +101,55 @@ void sis_send_uni_ok(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req)
   hi_send2(hit, io, req, resp, len, resp->m, size, req->m + len);
 }
 
+/* A DTS link became congested (on == 0) by traffic of sap, or drained (on == 1),
+ * see dts_sched_queue() and dts_flow_on(). Each link counts once in n_flow_off, so
+ * the clients bound to sap are told to stop sending S_UNIDATA_REQUESTs when the
+ * first link backs up, and to resume only when the last one has drained. */
+
+void sis_send_flow(struct hi_thr* hit, int sap, int on)
+{
+  struct hi_io* ios[SIS_MAX_SAP_CLIENTS];
+  int i, n = 0, n_off;
+  LOCK(saptab_mut, "flow");
+  n_off = saptab[sap].n_flow_off += on ? -1 : 1;
+  if (n_off == !on)  /* first link congested, or last one drained */
+    for (i = 0; i < SIS_MAX_SAP_CLIENTS; ++i)
+      if (saptab[sap].cl[i].io)
+	ios[n++] = saptab[sap].cl[i].io;
+  UNLOCK(saptab_mut, "flow");
+  D("sap(%d) flow %s n_flow_off(%d) to %d clients", sap, on ? "on" : "off", n_off, n);
+  for (i = 0; i < n; ++i)
+    sis_send_flow1(hit, ios[i], on);
+}
+
 /* ================== DECODING SIS PRIMITIVES ================== */
 
-void sis_clean(struct hi_io* io)
+/* Publish the client of highest rank, the first to bind among equals, as the one
+ * that gets the indications of the SAP. Caller holds saptab_mut. */
+
+static void sis_sap_elect(struct sis_sap* sp)
 {
+  struct sis_client* best = 0;
   int i;
+  for (i = 0; i < SIS_MAX_SAP_CLIENTS; ++i)
+    if (sp->cl[i].io && (!best || sp->cl[i].rank > best->rank))
+      best = &sp->cl[i];
+  sp->io = best ? best->io : 0;
+}
+
+/* Unbind io, if bound. Called on every hi_close(), so it goes straight to the
+ * entry of the client rather than scanning saptab. */
+
+void sis_clean(struct hi_io* io)
+{
+  struct sis_client* cl;
+  if (io->qel.proto != S5066_SIS || !(cl = io->ad.sis.cl))
+    return;
   LOCK(saptab_mut, "clean");
-  for (i = 0; i < SIS_MAX_SAP_ID; ++i)
-    if (saptab[i].io == io)
-      saptab[i].io = 0;
+  cl->io = 0;
+  sis_sap_elect(&saptab[io->ad.sis.sap]);
   UNLOCK(saptab_mut, "clean");
+  io->ad.sis.cl = 0;
 }
 
 #define SIS_LEN_CHECK(req, strct) MB if ((req)->len != SPRIM_TLEN(strct)) { \
@@ -108,32 +161,48 @@ void sis_clean(struct hi_io* io)
 	(req)->fe->fd, (req)->op, (req)->len, SPRIM_TLEN(strct)); \
     return HI_CONN_CLOSE; } ME
 
+/* Up to SIS_MAX_SAP_CLIENTS may bind the same SAP, the one of highest rank gets
+ * the indications, see sis_sap_elect(). A connection binds at most one SAP. */
+
 static int sis_bind(struct hi_thr* hit, struct hi_pdu* req)
 {
-  int sap, mtu;
+  struct sis_client* cl = 0;
+  int i, sap, mtu, off;
   SIS_LEN_CHECK(req, bind_request);
   sap = ((struct s_hdr*)req->m)->sprim.bind_request.sap_id;
   LOCK(saptab_mut, "bind");
-  if (saptab[sap].io) {
+  if (!req->fe->ad.sis.cl)
+    for (i = 0; i < SIS_MAX_SAP_CLIENTS; ++i)
+      if (!saptab[sap].cl[i].io) {
+	cl = &saptab[sap].cl[i];
+	break;
+      }
+  if (!cl) {
     UNLOCK(saptab_mut, "bind rej");
-    D("Rejecting bind fd(%x)", req->fe->fd);
+    D("Rejecting bind fd(%x) sap(%d)", req->fe->fd, sap);
     sis_send_bind_rej(hit, req->fe, req, SAP_ALRDY_ALLOC);
+    return 0;
   }
-  saptab[sap].io = req->fe; /* grab a slot */
-  saptab[sap].rank    = ((struct s_hdr*)req->m)->sprim.bind_request.rank;
-  saptab[sap].tx_mode = ((struct s_hdr*)req->m)->sprim.bind_request.service_type.tx_mode;
-  saptab[sap].n_re_tx = ((struct s_hdr*)req->m)->sprim.bind_request.service_type.no_retxs;
-  saptab[sap].flags
+  cl->rank    = ((struct s_hdr*)req->m)->sprim.bind_request.rank;
+  cl->tx_mode = ((struct s_hdr*)req->m)->sprim.bind_request.service_type.tx_mode;
+  cl->n_re_tx = ((struct s_hdr*)req->m)->sprim.bind_request.service_type.no_retxs;
+  cl->flags
     = ((struct s_hdr*)req->m)->sprim.bind_request.service_type.dlvry_cnfrm << 2
     | ((struct s_hdr*)req->m)->sprim.bind_request.service_type.dlvry_ordr << 1
     | ((struct s_hdr*)req->m)->sprim.bind_request.service_type.ext_fld
     ;
+  cl->io = req->fe;  /* grab the entry */
+  req->fe->ad.sis.sap = sap;
+  req->fe->ad.sis.cl = cl;
+  sis_sap_elect(&saptab[sap]);
   mtu = sismtu;
+  off = saptab[sap].n_flow_off;
   UNLOCK(saptab_mut, "bind ok");
   
-  D("bind accepted sap(%d) req(%p)", sap, req);
-  req->fe->ad.sap = sap;
+  D("bind accepted sap(%d) rank(%d) req(%p) n_flow_off(%d)", sap, cl->rank, req, off);
   sis_send_bind_ok(hit, req->fe, req, sap, mtu);
+  if (off)  /* links are congested by the SAP already */
+    sis_send_flow1(hit, req->fe, 0);
   return 0;
 }
 
@@ -282,7 +351,7 @@ static int sis_hlr(struct hi_thr* hit, struct hi_pdu* req)
   return 0;
 }
 
-/* Send unidata to DTS */
+/* Send unidata, or expedited unidata, to DTS */
 
 int sis_uni(struct hi_thr* hit, struct hi_pdu* req)
 {
@@ -295,17 +364,15 @@ int sis_uni(struct hi_thr* hit, struct hi_pdu* req)
     return HI_CONN_CLOSE;
   }
   
-  D("unidata send req(%p)", req);
-  if (!prototab[S5066_DTS].specs) {
-    ERR("No connection available for DTS %d",0);
-    return 0;
-  }
-  dts_send_uni(hit, prototab[S5066_DTS].specs->conns,
-	       req, len, req->m + SIS_MIN_PDU_SIZE + SIS_UNIHDR_SIZE);
+  D("unidata send req(%p) op(%x)", req, req->op);
+  hi_pdu_unshare(hit, req);  /* ARQ may hold it for long, see dts_arq_ack() */
+  hi_pdu_hold(req);  /* D_PDUs may all be written before we are done with req */
+  dts_send_uni(hit, req, len, req->m + SIS_MIN_PDU_SIZE + SIS_UNIHDR_SIZE,
+	       req->op == S_EXPEDITED_UNIDATA_REQUEST);
   
   confirm = ((struct s_hdr*)req->m)->sprim.unidata_req.delivery_mode.dlvry_cnfrm;
-  if (!confirm)
-    confirm = (saptab[req->fe->ad.sap].flags >> 2) & 0x3;
+  if (!confirm && req->fe->ad.sis.cl)
+    confirm = (req->fe->ad.sis.cl->flags >> 2) & 0x3;
   
   switch (confirm) {
   case NO_CONFRM:     /* 0x0 */
@@ -325,25 +392,28 @@ int sis_uni(struct hi_thr* hit, struct hi_pdu* req)
     D("UNDEF_CONFRM, treating as NO_CONFRM %x", req->fe->fd);
     goto noconf;
   }
+  hi_pdu_release(hit, req);
   return 0;
 }
 
-/* Receive unidata from SIS */
+/* Receive unidata, or expedited unidata, from SIS. The latter has no
+ * priority, nor the lists of errored and non received blocks. */
 
 int sis_uni_ind(struct hi_thr* hit, struct hi_pdu* req)
 {
-  struct hi_io* io;
-  int confirm, len, n_in_err, n_no_send, dest_sap;
+  int len, n_in_err, n_no_send, dest_sap;
   char* d;
   SIS_LEN_CHECK2(req, unidata_ind);   /* *** need to handle different sized arq as well */
   dest_sap = ((struct s_hdr*)req->m)->sprim.unidata_ind.dest_sap_id;
   len = (req->m[16] << 8) & 0xff00 | req->m[17] & 0x00ff;
   /*len = ((struct s_hdr*)req->m)->sprim.unidata_ind.size_of_u_pdu; *** struct access has some byte order problem */
   d = req->m + SPRIM_TLEN(unidata_ind);
-  n_in_err = (d[0] << 8) & 0xff00 | d[1] & 0x00ff;
-  d += 2 + 4 * n_in_err;
-  n_no_send = (d[0] << 8) & 0xff00 | d[1] & 0x00ff;
-  d += 2 + 4 * n_no_send;
+  if (req->op == S_UNIDATA_INDICATION) {
+    n_in_err = (d[0] << 8) & 0xff00 | d[1] & 0x00ff;
+    d += 2 + 4 * n_in_err;
+    n_no_send = (d[0] << 8) & 0xff00 | d[1] & 0x00ff;
+    d += 2 + 4 * n_no_send;
+  }
   
   if (d - req->m + len != req->len) {
     ERR("Bad SIS PDU. fd(%x) u_pdu_len(%x) disagrees with s_len(%x)", req->fe->fd, len, req->len);
@@ -389,9 +459,9 @@ int sis_primitive(struct hi_thr* hit, struct hi_pdu* req)
   case S_UNIDATA_REQUEST:           /* 0x14 */  return sis_uni(hit, req);
   case S_UNIDATA_INDICATION:        /* 0x15 */  return sis_uni_ind(hit, req);
   case S_UNIDATA_REQUEST_CONFIRM:   /* 0x16 */
-  case S_UNIDATA_REQUEST_REJECTED:  /* 0x17 */
-  case S_EXPEDITED_UNIDATA_REQUEST: /* 0x18 */
-  case S_EXPEDITED_UNIDATA_INDICATION: /* 0x19 */
+  case S_UNIDATA_REQUEST_REJECTED:  /* 0x17 */ break;
+  case S_EXPEDITED_UNIDATA_REQUEST: /* 0x18 */  return sis_uni(hit, req);
+  case S_EXPEDITED_UNIDATA_INDICATION: /* 0x19 */  return sis_uni_ind(hit, req);
   case S_EXPEDITED_UNIDATA_REQUEST_CONFIRM: /* 0x1a */
   case S_EXPEDITED_UNIDATA_REQUEST_REJECTED: /* 0x1b */
     break;
@@ -411,7 +481,7 @@ int sis_decode(struct hi_thr* hit, struct hi_io* io)
   int n = req->ap - req->m;
   
   if (n < SIS_MIN_PDU_SIZE) {   /* too little, need more */
-    req->need = SIS_MIN_PDU_SIZE - n;
+    req->need = SIS_MIN_PDU_SIZE;
     return 0;
   }
   
@@ -422,15 +492,15 @@ int sis_decode(struct hi_thr* hit, struct hi_io* io)
   
   req->len = (req->m[3] << 8) | (req->m[4] & 0x00ff); /* exclusive of preamble, version, and len */
 
-  if (req->len > SIS_MAX_PDU_SIZE - SIS_MIN_PDU_SIZE || req->len + SIS_MIN_PDU_SIZE > HI_PDU_MEM) {
-    ERR("Bad SIS PDU. fd(%x) length(%d) exceeds SIS_MAX_PDU_SIZE(%d) or HI_PDU_MEM(%d) op(%x)",
-	io->fd, req->len, SIS_MAX_PDU_SIZE, HI_PDU_MEM, req->m[5]);
+  if (req->len > SIS_MAX_PDU_SIZE - SIS_MIN_PDU_SIZE) {  /* hi_read() grows buffer as needed */
+    ERR("Bad SIS PDU. fd(%x) length(%d) exceeds SIS_MAX_PDU_SIZE(%d) op(%x)",
+	io->fd, req->len, SIS_MAX_PDU_SIZE, req->m[5]);
     return HI_CONN_CLOSE;
   }
   
   req->len += SIS_MIN_PDU_SIZE;  /* len is exclusive of preamble and len itself */
   if (n < req->len) {   
-    req->need = req->len - n;
+    req->need = req->len;
     return 0;
   }
   hi_checkmore(hit, io, req, SIS_MIN_PDU_SIZE);
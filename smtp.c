@@ -20,12 +20,12 @@
 
 /* ================== SENDING SMTP PRIMITIVES ================== */
 
-extern char remote_station_addr[];
+extern char remote_station_addr[];  /* HMTP peer node, see -hmtp */
 
 static void hmtp_send(struct hi_thr* hit, struct hi_io* io, int len, char* d, int len2, char* d2)
 {
   struct hi_pdu* resp = sis_encode_start(hit, S_UNIDATA_REQUEST,
-					 SPRIM_TLEN(unidata_req) + len + len2);
+					 SPRIM_TLEN(unidata_req) + len + len2, 17);
   resp->m[6]  = SAP_ID_HMTP;
   memcpy(resp->m + 7, /*io->ad.dts->remote_station_addr*/ remote_station_addr, 4);
   resp->m[11] = 0x20;    /* nonarq delivery mode */
@@ -82,7 +82,7 @@ void smtp_send(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req, int len
   case HI_TCP_S:   /* We are acting as an SMTP server, SIS primitive contains HMTP status  */
     D("HI_TCP_S req(%p) len=%x", req, len);
     /* *** may need to strip away some redundant cruft */
-    smtp_resp = hi_pdu_alloc(hit);
+    smtp_resp = hi_pdu_alloc(hit, 0);
     hi_send1(hit, io->pair, 0, smtp_resp, len, d);
     io->pair->ad.smtp.state = SMTP_END;
     break;
@@ -317,8 +317,6 @@ static int smtp_data(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req)
 
 int smtp_decode_req(struct hi_thr* hit, struct hi_io* io)
 {
-  int ret;
-  char* p;
   struct hi_pdu* req = io->cur_pdu;
   D("smtp_state(%d) scan(%.*s)", io->ad.smtp.state, MIN(7, req->ap - req->scan), req->scan);
   switch (io->ad.smtp.state) {
@@ -413,7 +411,7 @@ static int smtp_resp_wait_250_from_ehlo(struct hi_thr* hit, struct hi_io* io, st
       char* payload;
       char* q = io->ad.smtp.uni_ind_hmtp->scan;
       char* qlim = io->ad.smtp.uni_ind_hmtp->ap;
-      struct hi_pdu* pdu = hi_pdu_alloc(hit);
+      struct hi_pdu* pdu = hi_pdu_alloc(hit, 0);
       
       if (qlim-q < 25)   /* *** should determine this number better */
 	goto badhmtp;
@@ -522,7 +520,7 @@ static int smtp_resp_wait_354_from_data(struct hi_thr* hit, struct hi_io* io, st
       char* payload;
       char* q = io->ad.smtp.uni_ind_hmtp->scan;
       char* qlim = io->ad.smtp.uni_ind_hmtp->ap;
-      struct hi_pdu* pdu = hi_pdu_alloc(hit);
+      struct hi_pdu* pdu = hi_pdu_alloc(hit, 0);
       
       payload = q;
       --q;  /* Take the new line from preceding DATA to avoid special case later */
@@ -645,8 +643,6 @@ static int smtp_resp_wait_221_goodbye(struct hi_thr* hit, struct hi_io* io, stru
 
 int smtp_decode_resp(struct hi_thr* hit, struct hi_io* io)
 {
-  int ret;
-  char* p;
   struct hi_pdu* resp = io->cur_pdu;
   D("smtp_state(%d) scan(%.*s)", io->ad.smtp.state, MIN(7, resp->ap - resp->scan), resp->scan);
   switch (io->ad.smtp.state) {
@@ -22,10 +22,11 @@ void test_ping_reply(struct hi_thr* hit, struct hi_io* io, struct hi_pdu* req)
 {
   int i;
   int n = req->ap - req->m;
-  struct hi_pdu* resp = hi_pdu_alloc(hit);
+  struct hi_pdu* resp = hi_pdu_alloc(hit, n);
   if (!resp) { NEVERNEVER("*** out of pdus in bad place %d", n); }
   memcpy(resp->ap, req->m, n);
   resp->ap += n;
+  resp->len = n;
   for (i = n-1; i; --i)  /* all but the first letter */
     resp->m[i] = toupper(resp->m[i]);
   D("test_ping(%.*s) %d chars", n, resp->m, n);
@@ -38,12 +39,12 @@ void test_ping(struct hi_thr* hit, struct hi_io* io)
   int n = req->ap - req->m;
   
   if (n < MIN_PING) {   /* too little, need more */
-    req->need = MIN_PING - n;
+    req->need = MIN_PING;
     return;
   }
   
   if (n > MAX_PING) {  /* more than enough */
-    struct hi_pdu* nreq = hi_pdu_alloc(hit);
+    struct hi_pdu* nreq = hi_pdu_alloc(hit, HI_PDU_MEM);
     if (!nreq) { NEVERNEVER("*** out of pdus in bad place %d", n); }
     memcpy(nreq->ap, req->m + MAX_PING, n - MAX_PING);
     nreq->ap += n - MAX_PING;
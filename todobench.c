@@ -0,0 +1,114 @@
+/* todobench.c  -  Measure the todo queue under contention
+ * Copyright (c) 2006 Sampo Kellomaki (sampo@iki.fi), All Rights Reserved.
+ * See file COPYING.
+ *
+ * Usage: make todobench; ./todobench [PRODUCERS [CONSUMERS [MITEMS]]]
+ *
+ * PRODUCERS threads (default 1, 2, 4, and 8 in turn) each put MITEMS million
+ * (default 4) items to the todo queue of one shuffler with hi_todo_produce(),
+ * as senders on other threads do when they schedule an io, while CONSUMERS
+ * threads (default 1) take them with hi_todo_consume(), parking when the queue
+ * is empty, as hi_shuffle() does. Each producer cycles through its own ring of
+ * items and waits for an item to be consumed before producing it again.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "errmac.h"
+#include "hiios.h"
+
+#define RING 256  /* items per producer */
+
+/* What s5066d.c would define for the modules linked in */
+
+char* instance = "todobench";
+char* assert_msg = "%s: ASSERT fired\n";
+int assert_nonfatal = 0;
+int debug = 0;
+int debugpoll = 0;
+int timeout = 0;
+int nfd = 64;
+int nkbuf = 0;
+int uring = 0;
+int listen_backlog = 128;
+char remote_station_addr[4];
+struct hi_proto prototab[] = { { "" } };
+
+static struct hiios* shf;
+static int n_items;         /* per producer */
+static volatile int n_left; /* items yet to be consumed */
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void* producer(void* arg)
+{
+  struct hi_qel* ring = arg;
+  int i;
+  for (i = 0; i < n_items; ++i) {
+    while (ring[i % RING].inqueue)  /* consumer releases it, see hi_todo_pop() */
+      sched_yield();
+    hi_todo_produce(shf, &ring[i % RING]);
+  }
+  return 0;
+}
+
+static void* consumer(void* arg)
+{
+  while (__sync_sub_and_fetch(&n_left, 1) >= 0)
+    hi_todo_consume(shf);
+  return 0;
+}
+
+static void run(int n_prod, int n_con)
+{
+  pthread_t tid[64];
+  struct hi_qel* ring;
+  double t;
+  int i;
+
+  ZMALLOCN(ring, sizeof(struct hi_qel) * RING * n_prod);
+  n_left = n_items * n_prod;
+  t = now();
+  for (i = 0; i < n_con; ++i)
+    pthread_create(&tid[i], 0, consumer, 0);
+  for (i = 0; i < n_prod; ++i)
+    pthread_create(&tid[n_con + i], 0, producer, ring + i * RING);
+  for (i = 0; i < n_con + n_prod; ++i)
+    pthread_join(tid[i], 0);
+  t = now() - t;
+  printf("%2d producers %2d consumers %8.2f M items/s %7.1f ns/item\n",
+	 n_prod, n_con, n_items * n_prod / 1e6 / t, t * 1e9 / (n_items * n_prod));
+  free(ring);
+}
+
+int main(int argc, char** argv, char** env)
+{
+  int n_prod = argc > 1 ? atoi(argv[1]) : 0;
+  int n_con = argc > 2 ? atoi(argv[2]) : 1;
+  n_items = (argc > 3 ? atoi(argv[3]) : 4) * 1000000;
+  if (n_prod < 0 || n_prod > 32 || n_con < 1 || n_con > 32) {
+    fprintf(stderr, "Usage: todobench [PRODUCERS [CONSUMERS [MITEMS]]]\n");
+    return 1;
+  }
+
+  shf = hi_new_shuffler(nfd, 1000);
+  shf->poll_tok.proto = 0;  /* no polling thread: an empty queue parks consumers */
+  if (n_prod)
+    run(n_prod, n_con);
+  else
+    for (n_prod = 1; n_prod <= 8; n_prod *= 2)
+      run(n_prod, n_con);
+  return 0;
+}
+
+/* EOF  --  todobench.c */